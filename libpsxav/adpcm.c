@@ -23,9 +23,15 @@ freely, subject to the following restrictions:
 */
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #include "libpsxav.h"
 
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define ADPCM_USE_X86_SIMD
+#include <immintrin.h>
+#endif
+
 #define SHIFT_RANGE_4BPS 12
 #define SHIFT_RANGE_8BPS 8
 
@@ -36,6 +42,25 @@ freely, subject to the following restrictions:
 static const int16_t filter_k1[ADPCM_FILTER_COUNT] = {0, 60, 115, 98, 122};
 static const int16_t filter_k2[ADPCM_FILTER_COUNT] = {0, 0, -52, -55, -60};
 
+// Noise shaping feeds back past quantization errors, filtered so that the
+// resulting noise spectrum is (1 - 0.5 z^-1)^order times the original one,
+// i.e. pushed towards higher frequencies. The coefficients are in 8.8 fixed
+// point and the feedback is clamped to keep the loop from running away when
+// the decoder output saturates.
+#define NOISE_SHAPING_MAX_FEEDBACK 0x2000
+
+static const int16_t noise_shaping_coeffs[PSX_AUDIO_NOISE_SHAPING_MAX_ORDER + 1][PSX_AUDIO_NOISE_SHAPING_MAX_ORDER] = {
+	{  0,    0,  0},
+	{128,    0,  0},
+	{256,  -64,  0},
+	{384, -192, 32}
+};
+
+// Depending on the preset, 1, 3 or 5 shift values around the estimated one are
+// tried for each filter, or all of them.
+#define MAX_CANDIDATE_COUNT (ADPCM_FILTER_COUNT * (SHIFT_RANGE_4BPS + 1))
+#define SPU_BLOCKS_PER_CHUNK 64
+
 static int find_min_shift(
 	const psx_audio_encoder_channel_state_t *state,
 	const int16_t *samples,
@@ -89,8 +114,11 @@ static uint8_t attempt_to_encode(
 	int data_pitch,
 	int filter,
 	int sample_shift,
-	int shift_range
+	int shift_range,
+	int shaping_order,
+	uint64_t mse_limit
 ) {
+	const int16_t *shaping_coeffs = noise_shaping_coeffs[shaping_order];
 	uint8_t sample_mask = 0xFFFF >> shift_range;
 	uint8_t nondata_mask = ~(sample_mask << data_shift);
 
@@ -107,7 +135,16 @@ static uint8_t attempt_to_encode(
 	outstate->mse = 0;
 
 	for (int i = 0; i < PSX_AUDIO_SPU_SAMPLES_PER_BLOCK; i++) {
-		int32_t sample = ((i >= sample_limit) ? 0 : samples[i * pitch]) + outstate->qerr;
+		int32_t feedback = (
+			shaping_coeffs[0]*outstate->qerr[0] +
+			shaping_coeffs[1]*outstate->qerr[1] +
+			shaping_coeffs[2]*outstate->qerr[2] +
+			(1<<7)
+		)>>8;
+		if (feedback > +NOISE_SHAPING_MAX_FEEDBACK) { feedback = +NOISE_SHAPING_MAX_FEEDBACK; }
+		if (feedback < -NOISE_SHAPING_MAX_FEEDBACK) { feedback = -NOISE_SHAPING_MAX_FEEDBACK; }
+
+		int32_t sample = ((i >= sample_limit) ? 0 : samples[i * pitch]) - feedback;
 		int32_t previous_values = (k1*outstate->prev1 + k2*outstate->prev2 + (1<<5))>>6;
 		int32_t sample_enc = sample - previous_values;
 		sample_enc <<= min_shift;
@@ -128,106 +165,1004 @@ static uint8_t attempt_to_encode(
 		assert(sample_error > -(1<<30));
 
 		data[i * data_pitch] = (data[i * data_pitch] & nondata_mask) | (sample_enc << data_shift);
-		// FIXME: dithering is hard to predict
-		//outstate->qerr += sample_error;
 		outstate->mse += ((uint64_t)sample_error) * (uint64_t)sample_error;
 
 		outstate->prev2 = outstate->prev1;
 		outstate->prev1 = sample_dec;
+
+		if (shaping_order) {
+			outstate->qerr[2] = outstate->qerr[1];
+			outstate->qerr[1] = outstate->qerr[0];
+			outstate->qerr[0] = sample_error;
+		}
+
+		// Give up early if this can no longer beat the best candidate found
+		// so far.
+		if (outstate->mse > mse_limit)
+			break;
 	}
 
 	return hdr;
 }
 
-static uint8_t encode(
-	psx_audio_encoder_channel_state_t *state,
+// The functions below score several filter/shift combinations in parallel,
+// one per vector lane, by running the same prediction/quantization steps as
+// attempt_to_encode() and summing up the squared error. The results must
+// match attempt_to_encode() exactly; only the best candidate is then encoded
+// for real. Each lane may also encode a different block (i.e. a different
+// channel) starting from a different state. Lanes are abandoned early once
+// their error grows past their mse_limit and get an arbitrary score above it
+// (the kernel stops when this happens to all lanes). If
+// store_encoded is set, the quantized samples and the state each lane ends up
+// in are also saved, so the kernels can be used for the actual encoding too.
+#define SIMD_LANES 8
+
+typedef struct {
+	bool shared_samples; // if true, all lanes use the samples in lane 0
+	bool store_encoded;
+	int32_t samples[PSX_AUDIO_SPU_SAMPLES_PER_BLOCK][SIMD_LANES];
+	int32_t encoded[PSX_AUDIO_SPU_SAMPLES_PER_BLOCK][SIMD_LANES];
+	int32_t prev1[SIMD_LANES];
+	int32_t prev2[SIMD_LANES];
+	int32_t qerr[PSX_AUDIO_NOISE_SHAPING_MAX_ORDER][SIMD_LANES];
+	int32_t k1[SIMD_LANES];
+	int32_t k2[SIMD_LANES];
+	int32_t shift[SIMD_LANES];
+	uint64_t mse_limit[SIMD_LANES];
+} simd_lanes_t;
+
+// The 64-bit comparisons used by the kernels are signed, so limits must not
+// wrap around.
+static inline int64_t get_lane_mse_limit(const simd_lanes_t *lanes, int lane) {
+	return (lanes->mse_limit[lane] > INT64_MAX) ? INT64_MAX : (int64_t)lanes->mse_limit[lane];
+}
+
+#ifdef ADPCM_USE_X86_SIMD
+// Processes 4 lanes starting from the given one.
+__attribute__((target("sse4.1")))
+static void score_lanes_sse41(
+	simd_lanes_t *lanes,
+	int lane,
+	int shift_range,
+	int shaping_order,
+	uint64_t *mse
+) {
+	const __m128i range = _mm_cvtsi32_si128(shift_range);
+	const __m128i enc_round = _mm_set1_epi32(1 << (shift_range - 1));
+	const __m128i enc_min = _mm_set1_epi32(-0x8000 >> shift_range);
+	const __m128i enc_max = _mm_set1_epi32(+0x7FFF >> shift_range);
+	const __m128i dec_min = _mm_set1_epi32(-0x8000);
+	const __m128i dec_max = _mm_set1_epi32(+0x7FFF);
+	const __m128i filter_round = _mm_set1_epi32(1 << 5);
+	const __m128i shaping_c1 = _mm_set1_epi32(noise_shaping_coeffs[shaping_order][0]);
+	const __m128i shaping_c2 = _mm_set1_epi32(noise_shaping_coeffs[shaping_order][1]);
+	const __m128i shaping_c3 = _mm_set1_epi32(noise_shaping_coeffs[shaping_order][2]);
+	const __m128i shaping_round = _mm_set1_epi32(1 << 7);
+	const __m128i feedback_min = _mm_set1_epi32(-NOISE_SHAPING_MAX_FEEDBACK);
+	const __m128i feedback_max = _mm_set1_epi32(+NOISE_SHAPING_MAX_FEEDBACK);
+
+	int32_t shift_mul[4], unshift_mul[4];
+
+	// SSE4.1 has no per-lane shifts, so multiplications are used instead.
+	// Right shifts are done as (x * 2^(16 - shift)) >> 16, which is exact as
+	// x always fits in 16 bits.
+	for (int j = 0; j < 4; j++) {
+		shift_mul[j] = 1 << lanes->shift[lane + j];
+		unshift_mul[j] = 1 << (16 - lanes->shift[lane + j]);
+	}
+
+	__m128i v_k1 = _mm_loadu_si128((const __m128i *)&(lanes->k1[lane]));
+	__m128i v_k2 = _mm_loadu_si128((const __m128i *)&(lanes->k2[lane]));
+	__m128i v_shift_mul = _mm_loadu_si128((const __m128i *)shift_mul);
+	__m128i v_unshift_mul = _mm_loadu_si128((const __m128i *)unshift_mul);
+
+	__m128i prev1 = _mm_loadu_si128((const __m128i *)&(lanes->prev1[lane]));
+	__m128i prev2 = _mm_loadu_si128((const __m128i *)&(lanes->prev2[lane]));
+	__m128i qerr1 = _mm_loadu_si128((const __m128i *)&(lanes->qerr[0][lane]));
+	__m128i qerr2 = _mm_loadu_si128((const __m128i *)&(lanes->qerr[1][lane]));
+	__m128i qerr3 = _mm_loadu_si128((const __m128i *)&(lanes->qerr[2][lane]));
+	__m128i mse_even = _mm_setzero_si128();
+	__m128i mse_odd = _mm_setzero_si128();
+
+	for (int j = 0; j < PSX_AUDIO_SPU_SAMPLES_PER_BLOCK; j++) {
+		__m128i sample = lanes->shared_samples
+			? _mm_set1_epi32(lanes->samples[j][0])
+			: _mm_loadu_si128((const __m128i *)&(lanes->samples[j][lane]));
+
+		if (shaping_order) {
+			__m128i feedback = _mm_add_epi32(_mm_mullo_epi32(shaping_c1, qerr1), _mm_mullo_epi32(shaping_c2, qerr2));
+			feedback = _mm_add_epi32(feedback, _mm_mullo_epi32(shaping_c3, qerr3));
+			feedback = _mm_srai_epi32(_mm_add_epi32(feedback, shaping_round), 8);
+			feedback = _mm_min_epi32(_mm_max_epi32(feedback, feedback_min), feedback_max);
+			sample = _mm_sub_epi32(sample, feedback);
+		}
+
+		__m128i previous_values = _mm_add_epi32(_mm_mullo_epi32(v_k1, prev1), _mm_mullo_epi32(v_k2, prev2));
+		previous_values = _mm_srai_epi32(_mm_add_epi32(previous_values, filter_round), 6);
+
+		__m128i sample_enc = _mm_mullo_epi32(_mm_sub_epi32(sample, previous_values), v_shift_mul);
+		sample_enc = _mm_sra_epi32(_mm_add_epi32(sample_enc, enc_round), range);
+		sample_enc = _mm_min_epi32(_mm_max_epi32(sample_enc, enc_min), enc_max);
+
+		if (lanes->store_encoded)
+			_mm_storeu_si128((__m128i *)&(lanes->encoded[j][lane]), sample_enc);
+
+		__m128i sample_dec = _mm_mullo_epi32(_mm_sll_epi32(sample_enc, range), v_unshift_mul);
+		sample_dec = _mm_add_epi32(_mm_srai_epi32(sample_dec, 16), previous_values);
+		sample_dec = _mm_min_epi32(_mm_max_epi32(sample_dec, dec_min), dec_max);
+
+		__m128i sample_error = _mm_sub_epi32(sample_dec, sample);
+
+		if (shaping_order) {
+			qerr3 = qerr2;
+			qerr2 = qerr1;
+			qerr1 = sample_error;
+		}
+
+		mse_even = _mm_add_epi64(mse_even, _mm_mul_epi32(sample_error, sample_error));
+		sample_error = _mm_srli_epi64(sample_error, 32);
+		mse_odd = _mm_add_epi64(mse_odd, _mm_mul_epi32(sample_error, sample_error));
+
+		prev2 = prev1;
+		prev1 = sample_dec;
+
+		// Check the partial errors every few samples. 64-bit comparisons
+		// require SSE4.2, so this is done in scalar code.
+		if ((j & 3) == 3) {
+			uint64_t even[2], odd[2];
+			_mm_storeu_si128((__m128i *)even, mse_even);
+			_mm_storeu_si128((__m128i *)odd, mse_odd);
+
+			if (
+				even[0] > lanes->mse_limit[lane + 0] && odd[0] > lanes->mse_limit[lane + 1] &&
+				even[1] > lanes->mse_limit[lane + 2] && odd[1] > lanes->mse_limit[lane + 3]
+			)
+				break;
+		}
+	}
+
+	if (lanes->store_encoded) {
+		_mm_storeu_si128((__m128i *)&(lanes->prev1[lane]), prev1);
+		_mm_storeu_si128((__m128i *)&(lanes->prev2[lane]), prev2);
+		_mm_storeu_si128((__m128i *)&(lanes->qerr[0][lane]), qerr1);
+		_mm_storeu_si128((__m128i *)&(lanes->qerr[1][lane]), qerr2);
+		_mm_storeu_si128((__m128i *)&(lanes->qerr[2][lane]), qerr3);
+	}
+
+	uint64_t even[2], odd[2];
+	_mm_storeu_si128((__m128i *)even, mse_even);
+	_mm_storeu_si128((__m128i *)odd, mse_odd);
+
+	for (int j = 0; j < 4; j++)
+		mse[j] = (j & 1) ? odd[j >> 1] : even[j >> 1];
+}
+
+__attribute__((target("avx2")))
+static void score_lanes_avx2(
+	simd_lanes_t *lanes,
+	int shift_range,
+	int shaping_order,
+	uint64_t *mse
+) {
+	const __m128i range = _mm_cvtsi32_si128(shift_range);
+	const __m256i enc_round = _mm256_set1_epi32(1 << (shift_range - 1));
+	const __m256i enc_min = _mm256_set1_epi32(-0x8000 >> shift_range);
+	const __m256i enc_max = _mm256_set1_epi32(+0x7FFF >> shift_range);
+	const __m256i dec_min = _mm256_set1_epi32(-0x8000);
+	const __m256i dec_max = _mm256_set1_epi32(+0x7FFF);
+	const __m256i filter_round = _mm256_set1_epi32(1 << 5);
+	const __m256i shaping_c1 = _mm256_set1_epi32(noise_shaping_coeffs[shaping_order][0]);
+	const __m256i shaping_c2 = _mm256_set1_epi32(noise_shaping_coeffs[shaping_order][1]);
+	const __m256i shaping_c3 = _mm256_set1_epi32(noise_shaping_coeffs[shaping_order][2]);
+	const __m256i shaping_round = _mm256_set1_epi32(1 << 7);
+	const __m256i feedback_min = _mm256_set1_epi32(-NOISE_SHAPING_MAX_FEEDBACK);
+	const __m256i feedback_max = _mm256_set1_epi32(+NOISE_SHAPING_MAX_FEEDBACK);
+	const __m256i mse_limit_even = _mm256_set_epi64x(
+		get_lane_mse_limit(lanes, 6), get_lane_mse_limit(lanes, 4),
+		get_lane_mse_limit(lanes, 2), get_lane_mse_limit(lanes, 0)
+	);
+	const __m256i mse_limit_odd = _mm256_set_epi64x(
+		get_lane_mse_limit(lanes, 7), get_lane_mse_limit(lanes, 5),
+		get_lane_mse_limit(lanes, 3), get_lane_mse_limit(lanes, 1)
+	);
+
+	__m256i v_k1 = _mm256_loadu_si256((const __m256i *)lanes->k1);
+	__m256i v_k2 = _mm256_loadu_si256((const __m256i *)lanes->k2);
+	__m256i v_shift = _mm256_loadu_si256((const __m256i *)lanes->shift);
+
+	__m256i prev1 = _mm256_loadu_si256((const __m256i *)lanes->prev1);
+	__m256i prev2 = _mm256_loadu_si256((const __m256i *)lanes->prev2);
+	__m256i qerr1 = _mm256_loadu_si256((const __m256i *)lanes->qerr[0]);
+	__m256i qerr2 = _mm256_loadu_si256((const __m256i *)lanes->qerr[1]);
+	__m256i qerr3 = _mm256_loadu_si256((const __m256i *)lanes->qerr[2]);
+	__m256i mse_even = _mm256_setzero_si256();
+	__m256i mse_odd = _mm256_setzero_si256();
+
+	for (int j = 0; j < PSX_AUDIO_SPU_SAMPLES_PER_BLOCK; j++) {
+		__m256i sample = lanes->shared_samples
+			? _mm256_set1_epi32(lanes->samples[j][0])
+			: _mm256_loadu_si256((const __m256i *)lanes->samples[j]);
+
+		if (shaping_order) {
+			__m256i feedback = _mm256_add_epi32(_mm256_mullo_epi32(shaping_c1, qerr1), _mm256_mullo_epi32(shaping_c2, qerr2));
+			feedback = _mm256_add_epi32(feedback, _mm256_mullo_epi32(shaping_c3, qerr3));
+			feedback = _mm256_srai_epi32(_mm256_add_epi32(feedback, shaping_round), 8);
+			feedback = _mm256_min_epi32(_mm256_max_epi32(feedback, feedback_min), feedback_max);
+			sample = _mm256_sub_epi32(sample, feedback);
+		}
+
+		__m256i previous_values = _mm256_add_epi32(_mm256_mullo_epi32(v_k1, prev1), _mm256_mullo_epi32(v_k2, prev2));
+		previous_values = _mm256_srai_epi32(_mm256_add_epi32(previous_values, filter_round), 6);
+
+		__m256i sample_enc = _mm256_sllv_epi32(_mm256_sub_epi32(sample, previous_values), v_shift);
+		sample_enc = _mm256_sra_epi32(_mm256_add_epi32(sample_enc, enc_round), range);
+		sample_enc = _mm256_min_epi32(_mm256_max_epi32(sample_enc, enc_min), enc_max);
+
+		if (lanes->store_encoded)
+			_mm256_storeu_si256((__m256i *)lanes->encoded[j], sample_enc);
+
+		__m256i sample_dec = _mm256_srav_epi32(_mm256_sll_epi32(sample_enc, range), v_shift);
+		sample_dec = _mm256_add_epi32(sample_dec, previous_values);
+		sample_dec = _mm256_min_epi32(_mm256_max_epi32(sample_dec, dec_min), dec_max);
+
+		__m256i sample_error = _mm256_sub_epi32(sample_dec, sample);
+
+		if (shaping_order) {
+			qerr3 = qerr2;
+			qerr2 = qerr1;
+			qerr1 = sample_error;
+		}
+
+		mse_even = _mm256_add_epi64(mse_even, _mm256_mul_epi32(sample_error, sample_error));
+		sample_error = _mm256_srli_epi64(sample_error, 32);
+		mse_odd = _mm256_add_epi64(mse_odd, _mm256_mul_epi32(sample_error, sample_error));
+
+		prev2 = prev1;
+		prev1 = sample_dec;
+
+		if ((j & 3) == 3) {
+			__m256i over_limit = _mm256_and_si256(
+				_mm256_cmpgt_epi64(mse_even, mse_limit_even),
+				_mm256_cmpgt_epi64(mse_odd, mse_limit_odd)
+			);
+
+			if (_mm256_movemask_epi8(over_limit) == -1)
+				break;
+		}
+	}
+
+	if (lanes->store_encoded) {
+		_mm256_storeu_si256((__m256i *)lanes->prev1, prev1);
+		_mm256_storeu_si256((__m256i *)lanes->prev2, prev2);
+		_mm256_storeu_si256((__m256i *)lanes->qerr[0], qerr1);
+		_mm256_storeu_si256((__m256i *)lanes->qerr[1], qerr2);
+		_mm256_storeu_si256((__m256i *)lanes->qerr[2], qerr3);
+	}
+
+	uint64_t even[4], odd[4];
+	_mm256_storeu_si256((__m256i *)even, mse_even);
+	_mm256_storeu_si256((__m256i *)odd, mse_odd);
+
+	for (int j = 0; j < 8; j++)
+		mse[j] = (j & 1) ? odd[j >> 1] : even[j >> 1];
+}
+
+// Returns the number of lanes that can be scored at once, or 0 if no SIMD
+// implementation is available.
+static int get_simd_lane_count(void) {
+	if (__builtin_cpu_supports("avx2"))
+		return 8;
+	if (__builtin_cpu_supports("sse4.1"))
+		return 4;
+
+	return 0;
+}
+
+static void score_lanes(
+	simd_lanes_t *lanes,
+	int lane_count,
+	int shift_range,
+	int shaping_order,
+	uint64_t *mse
+) {
+	if (lane_count == 8)
+		score_lanes_avx2(lanes, shift_range, shaping_order, mse);
+	else
+		score_lanes_sse41(lanes, 0, shift_range, shaping_order, mse);
+}
+#else
+static int get_simd_lane_count(void) {
+	return 0;
+}
+
+static void score_lanes(
+	simd_lanes_t *lanes,
+	int lane_count,
+	int shift_range,
+	int shaping_order,
+	uint64_t *mse
+) {}
+#endif
+
+static void set_lane_state(simd_lanes_t *lanes, int lane, const psx_audio_encoder_channel_state_t *state) {
+	lanes->prev1[lane] = state->prev1;
+	lanes->prev2[lane] = state->prev2;
+
+	for (int i = 0; i < PSX_AUDIO_NOISE_SHAPING_MAX_ORDER; i++)
+		lanes->qerr[i][lane] = state->qerr[i];
+}
+
+static void score_candidates(
+	const psx_audio_encoder_channel_state_t *state,
 	const int16_t *samples,
 	int sample_limit,
 	int pitch,
-	uint8_t *data,
-	int data_shift,
-	int data_pitch,
-	int filter_count,
-	int shift_range
+	const int *filters,
+	const int *shifts,
+	int count,
+	int shift_range,
+	int shaping_order,
+	uint64_t mse_limit,
+	uint64_t *mse
 ) {
+	int lane_count = get_simd_lane_count();
+
+	if (lane_count) {
+		simd_lanes_t lanes;
+
+		// All lanes encode the same block from the same state.
+		lanes.shared_samples = true;
+		lanes.store_encoded = false;
+
+		for (int i = 0; i < PSX_AUDIO_SPU_SAMPLES_PER_BLOCK; i++)
+			lanes.samples[i][0] = (i >= sample_limit) ? 0 : samples[i * pitch];
+		for (int j = 0; j < SIMD_LANES; j++)
+			set_lane_state(&lanes, j, state);
+
+		for (int i = 0; i < count; i += lane_count) {
+			uint64_t lane_mse[SIMD_LANES];
+
+			// Unused lanes are filled with copies of the first candidate.
+			for (int j = 0; j < lane_count; j++) {
+				int n = ((i + j) < count) ? (i + j) : i;
+
+				lanes.k1[j] = filter_k1[filters[n]];
+				lanes.k2[j] = filter_k2[filters[n]];
+				lanes.shift[j] = shifts[n];
+				lanes.mse_limit[j] = mse_limit;
+			}
+
+			score_lanes(&lanes, lane_count, shift_range, shaping_order, lane_mse);
+
+			for (int j = 0; j < lane_count && (i + j) < count; j++) {
+				mse[i + j] = lane_mse[j];
+
+				if (mse_limit > mse[i + j])
+					mse_limit = mse[i + j];
+			}
+		}
+		return;
+	}
+
 	psx_audio_encoder_channel_state_t proposed;
-	int64_t best_mse = ((int64_t)1<<(int64_t)50);
-	int best_filter = 0;
-	int best_sample_shift = 0;
+	uint8_t data[PSX_AUDIO_SPU_SAMPLES_PER_BLOCK];
+
+	for (int i = 0; i < count; i++) {
+		// ignore header here
+		attempt_to_encode(
+			&proposed, state,
+			samples, sample_limit, pitch,
+			data, 0, 1,
+			filters[i], shifts[i], shift_range, shaping_order, mse_limit);
+
+		mse[i] = proposed.mse;
+
+		if (mse_limit > mse[i])
+			mse_limit = mse[i];
+	}
+}
+
+// Returns how many shift values on either side of the estimated minimum shift
+// should be tried, or -1 if all of them should.
+static int get_shift_spread(psx_audio_encoder_preset_t preset, int shaping_order) {
+	switch (preset) {
+		case PSX_AUDIO_ENCODER_PRESET_FAST:
+			return 0;
+
+		case PSX_AUDIO_ENCODER_PRESET_EXHAUSTIVE:
+			return -1;
+
+		default:
+			// The shaped signal may need more or less headroom than the
+			// input, so search a wider range around the estimated shift if
+			// noise shaping is on.
+			return shaping_order ? 2 : 1;
+	}
+}
+
+static int get_candidates(
+	const psx_audio_encoder_channel_state_t *state,
+	const int16_t *samples,
+	int sample_limit,
+	int pitch,
+	int filter_count,
+	int shift_range,
+	int shift_spread,
+	int *filters,
+	int *shifts
+) {
+	int count = 0;
 
 	for (int filter = 0; filter < filter_count; filter++) {
+		if (shift_spread < 0) {
+			for (int sample_shift = 0; sample_shift <= shift_range; sample_shift++) {
+				filters[count] = filter;
+				shifts[count] = sample_shift;
+				count++;
+			}
+			continue;
+		}
+
 		int true_min_shift = find_min_shift(state, samples, sample_limit, pitch, filter, shift_range);
 
 		// Testing has shown that the optimal shift can be off the true minimum shift
 		// by 1 in *either* direction.
 		// This is NOT the case when dither is used.
-		int min_shift = true_min_shift - 1;
-		int max_shift = true_min_shift + 1;
+		int min_shift = true_min_shift - shift_spread;
+		int max_shift = true_min_shift + shift_spread;
 		if (min_shift < 0) { min_shift = 0; }
 		if (max_shift > shift_range) { max_shift = shift_range; }
 
 		for (int sample_shift = min_shift; sample_shift <= max_shift; sample_shift++) {
-			// ignore header here
-			attempt_to_encode(
-				&proposed, state,
-				samples, sample_limit, pitch,
-				data, data_shift, data_pitch,
-				filter, sample_shift, shift_range);
-
-			if (best_mse > proposed.mse) {
-				best_mse = proposed.mse;
-				best_filter = filter;
-				best_sample_shift = sample_shift;
-			}
+			filters[count] = filter;
+			shifts[count] = sample_shift;
+			count++;
+		}
+	}
+
+	return count;
+}
+
+static uint8_t encode(
+	psx_audio_encoder_channel_state_t *state,
+	const int16_t *samples,
+	int sample_limit,
+	int pitch,
+	uint8_t *data,
+	int data_shift,
+	int data_pitch,
+	int filter_count,
+	int shift_range,
+	int shift_spread,
+	int shaping_order
+) {
+	int candidate_filters[MAX_CANDIDATE_COUNT];
+	int candidate_shifts[MAX_CANDIDATE_COUNT];
+	int candidate_order[MAX_CANDIDATE_COUNT];
+	uint64_t candidate_mse[MAX_CANDIDATE_COUNT];
+	int likely_candidate = -1;
+
+	int candidate_count = get_candidates(
+		state,
+		samples, sample_limit, pitch,
+		filter_count, shift_range, shift_spread,
+		candidate_filters, candidate_shifts);
+
+	for (int i = 0; i < candidate_count; i++) {
+		if (candidate_filters[i] == state->prev_filter && candidate_shifts[i] == state->prev_sample_shift)
+			likely_candidate = i;
+
+		candidate_order[i] = i;
+	}
+
+	// The filter and shift picked for the previous block are likely to be the
+	// best choice again, so try them first to make the other candidates bail
+	// out as early as possible.
+	for (int i = likely_candidate; i > 0; i--) {
+		candidate_filters[i] = candidate_filters[i - 1];
+		candidate_shifts[i] = candidate_shifts[i - 1];
+		candidate_order[i] = candidate_order[i - 1];
+	}
+	if (likely_candidate > 0) {
+		candidate_filters[0] = state->prev_filter;
+		candidate_shifts[0] = state->prev_sample_shift;
+		candidate_order[0] = likely_candidate;
+	}
+
+	uint64_t best_mse = ((uint64_t)1<<(uint64_t)50);
+	int best_order = candidate_count;
+	int best_filter = 0;
+	int best_sample_shift = 0;
+
+	score_candidates(
+		state,
+		samples, sample_limit, pitch,
+		candidate_filters, candidate_shifts, candidate_count,
+		shift_range, shaping_order, best_mse, candidate_mse);
+
+	// Ties are broken in favor of the candidate that would have been tried
+	// first in filter/shift order, so reordering does not affect the result.
+	for (int i = 0; i < candidate_count; i++) {
+		if (
+			best_mse > candidate_mse[i] ||
+			(best_mse == candidate_mse[i] && best_order > candidate_order[i])
+		) {
+			best_mse = candidate_mse[i];
+			best_order = candidate_order[i];
+			best_filter = candidate_filters[i];
+			best_sample_shift = candidate_shifts[i];
 		}
 	}
 
+	state->prev_filter = best_filter;
+	state->prev_sample_shift = best_sample_shift;
+
 	// now go with the encoder
 	return attempt_to_encode(
 		state, state,
 		samples, sample_limit, pitch,
 		data, data_shift, data_pitch,
-		best_filter, best_sample_shift, shift_range);
+		best_filter, best_sample_shift, shift_range, shaping_order, UINT64_MAX);
+}
+
+// A single block within a sequence of blocks belonging to the same channel.
+typedef struct {
+	const int16_t *samples;
+	int sample_limit;
+	uint8_t *data;
+	int data_shift;
+	uint8_t *header;
+} adpcm_block_t;
+
+typedef struct {
+	psx_audio_encoder_channel_state_t state;
+	uint64_t total_mse;
+	int parent;
+	int filter;
+	int sample_shift;
+} beam_path_t;
+
+typedef struct {
+	uint16_t parent;
+	uint8_t filter;
+	uint8_t sample_shift;
+} beam_step_t;
+
+// Inserts a new path into a list sorted by total error, keeping at most
+// beam_width entries and only one path for any given decoder state.
+static int insert_beam_path(beam_path_t *paths, int count, int beam_width, const beam_path_t *path) {
+	for (int i = 0; i < count; i++) {
+		if (
+			memcmp(paths[i].state.qerr, path->state.qerr, sizeof(path->state.qerr)) ||
+			paths[i].state.prev1 != path->state.prev1 ||
+			paths[i].state.prev2 != path->state.prev2
+		)
+			continue;
+		if (paths[i].total_mse <= path->total_mse)
+			return count;
+
+		memmove(paths + i, paths + i + 1, (count - i - 1) * sizeof(beam_path_t));
+		count--;
+		break;
+	}
+
+	int index = count;
+
+	while (index > 0 && paths[index - 1].total_mse > path->total_mse)
+		index--;
+	if (index >= beam_width)
+		return count;
+	if (count == beam_width)
+		count--;
+
+	memmove(paths + index + 1, paths + index, (count - index) * sizeof(beam_path_t));
+	memcpy(paths + index, path, sizeof(beam_path_t));
+	return count + 1;
+}
+
+// Rather than picking the best filter and shift for each block on its own,
+// keep track of the beam_width best ways to encode the sequence so far (each
+// leaving the decoder in a different state) and only settle on one at the end.
+// This avoids choices that look good locally but leave prev1/prev2 in a state
+// that makes the following blocks harder to encode.
+static void encode_blocks_beam(
+	psx_audio_encoder_channel_state_t *state,
+	const adpcm_block_t *blocks,
+	int block_count,
+	int pitch,
+	int data_pitch,
+	int filter_count,
+	int shift_range,
+	int shift_spread,
+	int shaping_order,
+	int beam_width
+) {
+	beam_path_t *paths = malloc(beam_width * 2 * sizeof(beam_path_t));
+	beam_step_t *steps = malloc(block_count * beam_width * sizeof(beam_step_t));
+	assert(paths && steps);
+
+	beam_path_t *current = paths;
+	beam_path_t *next = paths + beam_width;
+	int current_count = 1;
+
+	memcpy(&(current[0].state), state, sizeof(psx_audio_encoder_channel_state_t));
+	current[0].total_mse = 0;
+
+	for (int i = 0; i < block_count; i++) {
+		const adpcm_block_t *block = blocks + i;
+		int next_count = 0;
+
+		for (int j = 0; j < current_count; j++) {
+			int candidate_filters[MAX_CANDIDATE_COUNT];
+			int candidate_shifts[MAX_CANDIDATE_COUNT];
+			uint8_t data[PSX_AUDIO_SPU_SAMPLES_PER_BLOCK];
+
+			int candidate_count = get_candidates(
+				&(current[j].state),
+				block->samples, block->sample_limit, pitch,
+				filter_count, shift_range, shift_spread,
+				candidate_filters, candidate_shifts);
+
+			for (int k = 0; k < candidate_count; k++) {
+				uint64_t mse_limit = UINT64_MAX;
+
+				// Paths are sorted, so if the worst path kept so far is
+				// better than this one there is nothing left to gain from it.
+				if (next_count == beam_width) {
+					uint64_t worst_mse = next[beam_width - 1].total_mse;
+
+					if (current[j].total_mse >= worst_mse)
+						break;
+
+					mse_limit = worst_mse - current[j].total_mse;
+				}
+
+				beam_path_t path;
+				attempt_to_encode(
+					&(path.state), &(current[j].state),
+					block->samples, block->sample_limit, pitch,
+					data, 0, 1,
+					candidate_filters[k], candidate_shifts[k], shift_range, shaping_order, mse_limit);
+
+				if (path.state.mse > mse_limit)
+					continue;
+
+				path.state.prev_filter = candidate_filters[k];
+				path.state.prev_sample_shift = candidate_shifts[k];
+				path.total_mse = current[j].total_mse + path.state.mse;
+				path.parent = j;
+				path.filter = candidate_filters[k];
+				path.sample_shift = candidate_shifts[k];
+
+				next_count = insert_beam_path(next, next_count, beam_width, &path);
+			}
+		}
+
+		for (int j = 0; j < next_count; j++) {
+			beam_step_t *step = steps + i * beam_width + j;
+
+			step->parent = next[j].parent;
+			step->filter = next[j].filter;
+			step->sample_shift = next[j].sample_shift;
+		}
+
+		beam_path_t *temp = current;
+		current = next;
+		next = temp;
+		current_count = next_count;
+	}
+
+	// Walk back from the best path to find out which filter and shift was
+	// picked for each block, then actually encode the blocks.
+	for (int i = block_count - 1, index = 0; i >= 0; i--) {
+		beam_step_t step = steps[i * beam_width + index];
+
+		index = step.parent;
+		steps[i * beam_width] = step;
+	}
+
+	for (int i = 0; i < block_count; i++) {
+		const adpcm_block_t *block = blocks + i;
+		const beam_step_t *step = steps + i * beam_width;
+
+		*(block->header) = attempt_to_encode(
+			state, state,
+			block->samples, block->sample_limit, pitch,
+			block->data, block->data_shift, data_pitch,
+			step->filter, step->sample_shift, shift_range, shaping_order, UINT64_MAX);
+
+		state->prev_filter = step->filter;
+		state->prev_sample_shift = step->sample_shift;
+	}
+
+	free(paths);
+	free(steps);
+}
+
+static void encode_blocks(
+	psx_audio_encoder_settings_t settings,
+	psx_audio_encoder_channel_state_t *state,
+	const adpcm_block_t *blocks,
+	int block_count,
+	int pitch,
+	int data_pitch,
+	int filter_count,
+	int shift_range
+) {
+	int shaping_order = settings.noise_shaping_order;
+	assert(0 <= shaping_order && shaping_order <= PSX_AUDIO_NOISE_SHAPING_MAX_ORDER);
+
+	int shift_spread = get_shift_spread(settings.preset, shaping_order);
+
+	if (settings.beam_width > 1) {
+		encode_blocks_beam(state, blocks, block_count, pitch, data_pitch, filter_count, shift_range, shift_spread, shaping_order, settings.beam_width);
+		return;
+	}
+
+	for (int i = 0; i < block_count; i++) {
+		const adpcm_block_t *block = blocks + i;
+
+		*(block->header) = encode(
+			state,
+			block->samples, block->sample_limit, pitch,
+			block->data, block->data_shift, data_pitch,
+			filter_count, shift_range, shift_spread, shaping_order);
+	}
+}
+
+// Encodes one block for each of up to lane_count channels, spreading the
+// filter/shift combinations to try for all channels across the SIMD lanes
+// (each channel gets lane_count / channel_count lanes). The choices made are
+// the same as if encode() had been called on each channel separately.
+static void encode_channels(
+	psx_audio_encoder_channel_state_t *const *states,
+	const adpcm_block_t *const *blocks,
+	int channel_count,
+	int lane_count,
+	int pitch,
+	int data_pitch,
+	int filter_count,
+	int shift_range,
+	int shift_spread,
+	int shaping_order
+) {
+	simd_lanes_t lanes;
+	int min_shifts[SIMD_LANES][ADPCM_FILTER_COUNT];
+	uint64_t best_mse[SIMD_LANES];
+	int best_slot[SIMD_LANES];
+	int likely_slot[SIMD_LANES];
+
+	// When trying every shift, each filter's slots simply start from 0.
+	bool all_shifts = (shift_spread < 0);
+	if (all_shifts) { shift_spread = 0; }
+
+	int slots_per_filter = all_shifts ? (shift_range + 1) : (shift_spread * 2 + 1);
+	int slot_count = filter_count * slots_per_filter;
+	int lanes_per_channel = lane_count / channel_count;
+
+	lanes.shared_samples = false;
+	lanes.store_encoded = false;
+
+	// Lane j always works on channel (j % channel_count), so the samples and
+	// initial state only have to be set up once. Leftover lanes are filled
+	// with copies of the first channel.
+	for (int j = 0; j < lane_count; j++) {
+		int ch = (j < channel_count * lanes_per_channel) ? (j % channel_count) : 0;
+		const adpcm_block_t *block = blocks[ch];
+
+		for (int i = 0; i < PSX_AUDIO_SPU_SAMPLES_PER_BLOCK; i++)
+			lanes.samples[i][j] = (i >= block->sample_limit) ? 0 : block->samples[i * pitch];
+
+		set_lane_state(&lanes, j, states[ch]);
+	}
+
+	for (int ch = 0; ch < channel_count; ch++) {
+		const psx_audio_encoder_channel_state_t *state = states[ch];
+
+		for (int filter = 0; filter < filter_count; filter++)
+			min_shifts[ch][filter] = all_shifts ? 0 : find_min_shift(state, blocks[ch]->samples, blocks[ch]->sample_limit, pitch, filter, shift_range);
+
+		// As in encode(), try the filter and shift picked for the previous
+		// block first. The other slots follow in order.
+		likely_slot[ch] = 0;
+
+		if (state->prev_filter < filter_count) {
+			int offset = state->prev_sample_shift - min_shifts[ch][state->prev_filter] + shift_spread;
+
+			if (offset >= 0 && offset < slots_per_filter)
+				likely_slot[ch] = state->prev_filter * slots_per_filter + offset;
+		}
+
+		best_mse[ch] = UINT64_MAX;
+		best_slot[ch] = slot_count;
+	}
+
+	for (int first = 0; first < slot_count; first += lanes_per_channel) {
+		int lane_slots[SIMD_LANES];
+		uint64_t lane_mse[SIMD_LANES];
+
+		for (int j = 0; j < lane_count; j++) {
+			int ch = j % channel_count;
+			int n = first + j / channel_count;
+			bool used = (j < channel_count * lanes_per_channel) && (n < slot_count);
+
+			// Unused lanes just repeat a slot and bail out right away.
+			if (!used)
+				n = first;
+
+			int slot = (n == 0) ? likely_slot[ch] : (n - 1 < likely_slot[ch]) ? (n - 1) : n;
+			int filter = slot / slots_per_filter;
+			int sample_shift = min_shifts[ch][filter] + (slot % slots_per_filter) - shift_spread;
+			if (sample_shift < 0) { sample_shift = 0; }
+			if (sample_shift > shift_range) { sample_shift = shift_range; }
+
+			lane_slots[j] = used ? slot : -1;
+			lanes.k1[j] = filter_k1[filter];
+			lanes.k2[j] = filter_k2[filter];
+			lanes.shift[j] = sample_shift;
+			lanes.mse_limit[j] = used ? best_mse[ch] : 0;
+		}
+
+		score_lanes(&lanes, lane_count, shift_range, shaping_order, lane_mse);
+
+		// Ties are broken in favor of the slot that comes first in filter/shift
+		// order, which is also the order encode() tries candidates in (shifts
+		// clamped at either end of the range just get tried twice).
+		for (int j = 0; j < channel_count * lanes_per_channel; j++) {
+			int ch = j % channel_count;
+
+			if (lane_slots[j] < 0)
+				continue;
+			if (
+				best_mse[ch] > lane_mse[j] ||
+				(best_mse[ch] == lane_mse[j] && best_slot[ch] > lane_slots[j])
+			) {
+				best_mse[ch] = lane_mse[j];
+				best_slot[ch] = lane_slots[j];
+			}
+		}
+	}
+
+	// Now go with the encoder, one lane per channel.
+	lanes.store_encoded = true;
+
+	for (int j = 0; j < lane_count; j++) {
+		int ch = (j < channel_count) ? j : 0;
+		int filter = best_slot[ch] / slots_per_filter;
+		int sample_shift = min_shifts[ch][filter] + (best_slot[ch] % slots_per_filter) - shift_spread;
+		if (sample_shift < 0) { sample_shift = 0; }
+		if (sample_shift > shift_range) { sample_shift = shift_range; }
+
+		if (j != ch) {
+			for (int i = 0; i < PSX_AUDIO_SPU_SAMPLES_PER_BLOCK; i++)
+				lanes.samples[i][j] = lanes.samples[i][ch];
+		}
+
+		set_lane_state(&lanes, j, states[ch]);
+		lanes.k1[j] = filter_k1[filter];
+		lanes.k2[j] = filter_k2[filter];
+		lanes.shift[j] = sample_shift;
+		lanes.mse_limit[j] = UINT64_MAX;
+	}
+
+	uint64_t lane_mse[SIMD_LANES];
+	score_lanes(&lanes, lane_count, shift_range, shaping_order, lane_mse);
+
+	uint8_t sample_mask = 0xFFFF >> shift_range;
+
+	for (int ch = 0; ch < channel_count; ch++) {
+		psx_audio_encoder_channel_state_t *state = states[ch];
+		const adpcm_block_t *block = blocks[ch];
+		uint8_t nondata_mask = ~(sample_mask << block->data_shift);
+		int filter = best_slot[ch] / slots_per_filter;
+
+		for (int i = 0; i < PSX_AUDIO_SPU_SAMPLES_PER_BLOCK; i++) {
+			uint8_t *data = block->data + i * data_pitch;
+
+			*data = (*data & nondata_mask) | ((lanes.encoded[i][ch] & sample_mask) << block->data_shift);
+		}
+
+		state->mse = lane_mse[ch];
+		state->prev1 = lanes.prev1[ch];
+		state->prev2 = lanes.prev2[ch];
+
+		for (int i = 0; i < PSX_AUDIO_NOISE_SHAPING_MAX_ORDER; i++)
+			state->qerr[i] = lanes.qerr[i][ch];
+
+		state->prev_filter = filter;
+		state->prev_sample_shift = lanes.shift[ch];
+		*(block->header) = (lanes.shift[ch] & 0x0F) | (filter << 4);
+	}
 }
 
-static void encode_block_xa(
+// Encodes block_count blocks for each channel, processing multiple channels at
+// a time if possible. The blocks array holds all blocks for the first channel,
+// followed by all blocks for the second channel and so on.
+static void encode_blocks_interleaved(
+	psx_audio_encoder_settings_t settings,
+	psx_audio_encoder_channel_state_t *states,
+	const adpcm_block_t *blocks,
+	int channel_count,
+	int block_count,
+	int pitch,
+	int data_pitch,
+	int filter_count,
+	int shift_range
+) {
+	int lane_count = get_simd_lane_count();
+
+	// Beam search has to go through each channel's blocks on its own.
+	if (!lane_count || channel_count < 2 || settings.beam_width > 1) {
+		for (int ch = 0; ch < channel_count; ch++)
+			encode_blocks(settings, &states[ch], blocks + ch * block_count, block_count, pitch, data_pitch, filter_count, shift_range);
+		return;
+	}
+
+	int shaping_order = settings.noise_shaping_order;
+	assert(0 <= shaping_order && shaping_order <= PSX_AUDIO_NOISE_SHAPING_MAX_ORDER);
+
+	int shift_spread = get_shift_spread(settings.preset, shaping_order);
+
+	for (int first_ch = 0; first_ch < channel_count; first_ch += lane_count) {
+		psx_audio_encoder_channel_state_t *group_states[SIMD_LANES];
+		const adpcm_block_t *group_blocks[SIMD_LANES];
+		int group_count = channel_count - first_ch;
+
+		if (group_count > lane_count)
+			group_count = lane_count;
+
+		for (int i = 0; i < block_count; i++) {
+			for (int ch = 0; ch < group_count; ch++) {
+				group_states[ch] = &states[first_ch + ch];
+				group_blocks[ch] = &blocks[(first_ch + ch) * block_count + i];
+			}
+
+			encode_channels(group_states, group_blocks, group_count, lane_count, pitch, data_pitch, filter_count, shift_range, shift_spread, shaping_order);
+		}
+	}
+}
+
+// Each 128-byte XA sound group holds 8 (4-bit) or 4 (8-bit) blocks, whose
+// headers are stored at offsets 0-3 and 8-11. In stereo mode blocks alternate
+// between the left and right channel.
+static const uint8_t xa_header_offsets[8] = {0, 1, 2, 3, 8, 9, 10, 11};
+
+static void get_blocks_xa(
 	const int16_t *audio_samples,
 	int audio_samples_limit,
 	uint8_t *data,
 	psx_audio_xa_settings_t settings,
-	psx_audio_encoder_state_t *state
+	adpcm_block_t *left,
+	adpcm_block_t *right
 ) {
-	if (settings.bits_per_sample == 4) {
+	int block_count = (settings.bits_per_sample == 4) ? 8 : 4;
+
+	for (int i = 0; i < block_count; i++) {
+		adpcm_block_t *block;
+		int offset;
+
+		// The limit is given in interleaved samples, but compared against
+		// the index of each sample within its channel.
 		if (settings.stereo) {
-			data[0]  = encode(&(state->left),  audio_samples,            audio_samples_limit,        2, data + 0x10, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[1]  = encode(&(state->right), audio_samples + 1,        audio_samples_limit,        2, data + 0x10, 4, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[2]  = encode(&(state->left),  audio_samples + 56,       audio_samples_limit - 28,   2, data + 0x11, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[3]  = encode(&(state->right), audio_samples + 56 + 1,   audio_samples_limit - 28,   2, data + 0x11, 4, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[8]  = encode(&(state->left),  audio_samples + 56*2,     audio_samples_limit - 28*2, 2, data + 0x12, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[9]  = encode(&(state->right), audio_samples + 56*2 + 1, audio_samples_limit - 28*2, 2, data + 0x12, 4, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[10] = encode(&(state->left),  audio_samples + 56*3,     audio_samples_limit - 28*3, 2, data + 0x13, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[11] = encode(&(state->right), audio_samples + 56*3 + 1, audio_samples_limit - 28*3, 2, data + 0x13, 4, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
+			offset = i >> 1;
+			block = (i & 1) ? &right[offset] : &left[offset];
+			block->samples = audio_samples + offset * 56 + (i & 1);
+			block->sample_limit = audio_samples_limit / 2 - offset * 28;
 		} else {
-			data[0]  = encode(&(state->left), audio_samples,        audio_samples_limit,        1, data + 0x10, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[1]  = encode(&(state->left), audio_samples + 28,   audio_samples_limit - 28,   1, data + 0x10, 4, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[2]  = encode(&(state->left), audio_samples + 28*2, audio_samples_limit - 28*2, 1, data + 0x11, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[3]  = encode(&(state->left), audio_samples + 28*3, audio_samples_limit - 28*3, 1, data + 0x11, 4, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[8]  = encode(&(state->left), audio_samples + 28*4, audio_samples_limit - 28*4, 1, data + 0x12, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[9]  = encode(&(state->left), audio_samples + 28*5, audio_samples_limit - 28*5, 1, data + 0x12, 4, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[10] = encode(&(state->left), audio_samples + 28*6, audio_samples_limit - 28*6, 1, data + 0x13, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[11] = encode(&(state->left), audio_samples + 28*7, audio_samples_limit - 28*7, 1, data + 0x13, 4, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
+			offset = i;
+			block = &left[offset];
+			block->samples = audio_samples + offset * 28;
+			block->sample_limit = audio_samples_limit - offset * 28;
 		}
-	} else {
-		if (settings.stereo) {
-			data[0] = encode(&(state->left),  audio_samples,          audio_samples_limit,      2, data + 0x10, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_8BPS);
-			data[1] = encode(&(state->right), audio_samples + 1,      audio_samples_limit,      2, data + 0x11, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_8BPS);
-			data[2] = encode(&(state->left),  audio_samples + 56,     audio_samples_limit - 28, 2, data + 0x12, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_8BPS);
-			data[3] = encode(&(state->right), audio_samples + 56 + 1, audio_samples_limit - 28, 2, data + 0x13, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_8BPS);
+
+		block->header = data + xa_header_offsets[i];
+
+		if (settings.bits_per_sample == 4) {
+			block->data = data + 0x10 + (i >> 1);
+			block->data_shift = (i & 1) * 4;
 		} else {
-			data[0] = encode(&(state->left), audio_samples,        audio_samples_limit,        1, data + 0x10, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_8BPS);
-			data[1] = encode(&(state->left), audio_samples + 28,   audio_samples_limit - 28,   1, data + 0x11, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_8BPS);
-			data[2] = encode(&(state->left), audio_samples + 28*2, audio_samples_limit - 28*2, 1, data + 0x12, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_8BPS);
-			data[3] = encode(&(state->left), audio_samples + 28*3, audio_samples_limit - 28*3, 1, data + 0x13, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_8BPS);
+			block->data = data + 0x10 + i;
+			block->data_shift = 0;
 		}
 	}
 }
@@ -299,36 +1234,58 @@ int psx_audio_xa_encode(
 	uint8_t *output
 ) {
 	int sample_jump = (settings.bits_per_sample == 8) ? 112 : 224;
+	int shift_range = (settings.bits_per_sample == 8) ? SHIFT_RANGE_8BPS : SHIFT_RANGE_4BPS;
+	int blocks_per_group = ((settings.bits_per_sample == 8) ? 4 : 8) >> (settings.stereo ? 1 : 0);
+	int pitch = settings.stereo ? 2 : 1;
 	int i, j;
 	int xa_sector_size = psx_audio_xa_get_buffer_size_per_sector(settings);
 	int xa_offset = PSX_CDROM_SECTOR_SIZE - xa_sector_size;
-	uint8_t init_sector = 1;
 
 	if (settings.stereo)
 		sample_count *= 2;
 
-	for (i = 0, j = 0; i < sample_count || ((j % 18) != 0); i += sample_jump, j++) {
-		psx_cdrom_sector_mode2_t *sector_data = (psx_cdrom_sector_mode2_t*) (output + ((j/18) * xa_sector_size) - xa_offset);
-		uint8_t *block_data = sector_data->data + ((j%18) * 0x80);
+	// Sectors are encoded as a whole, so that the encoder can look ahead
+	// across all the sound groups in a sector when picking filters.
+	for (i = 0, j = 0; i < sample_count; j++) {
+		psx_cdrom_sector_mode2_t *sector_data = (psx_cdrom_sector_mode2_t*) (output + (j * xa_sector_size) - xa_offset);
+		adpcm_block_t blocks[18 * 8];
+
+		psx_audio_xa_encode_init_sector(sector_data, lba, settings);
+
+		for (int k = 0; k < 18; k++, i += sample_jump) {
+			get_blocks_xa(
+				samples + i, sample_count - i,
+				sector_data->data + (k * 0x80),
+				settings,
+				blocks + (k * blocks_per_group),
+				settings.stereo ? (blocks + ((18 + k) * blocks_per_group)) : NULL);
+		}
+
+		if (settings.stereo) {
+			psx_audio_encoder_channel_state_t states[2];
 
-		if (init_sector) {
-			psx_audio_xa_encode_init_sector(sector_data, lba, settings);
-			init_sector = 0;
+			memcpy(&states[0], &(state->left), sizeof(psx_audio_encoder_channel_state_t));
+			memcpy(&states[1], &(state->right), sizeof(psx_audio_encoder_channel_state_t));
+			encode_blocks_interleaved(settings.encoder, states, blocks, 2, 18 * blocks_per_group, pitch, 4, XA_ADPCM_FILTER_COUNT, shift_range);
+			memcpy(&(state->left), &states[0], sizeof(psx_audio_encoder_channel_state_t));
+			memcpy(&(state->right), &states[1], sizeof(psx_audio_encoder_channel_state_t));
+		} else {
+			encode_blocks(settings.encoder, &(state->left), blocks, 18 * blocks_per_group, pitch, 4, XA_ADPCM_FILTER_COUNT, shift_range);
 		}
 
-		encode_block_xa(samples + i, sample_count - i, block_data, settings, state);
+		for (int k = 0; k < 18; k++) {
+			uint8_t *block_data = sector_data->data + (k * 0x80);
 
-		memcpy(block_data + 4, block_data, 4);
-		memcpy(block_data + 12, block_data + 8, 4);
+			memcpy(block_data + 4, block_data, 4);
+			memcpy(block_data + 12, block_data + 8, 4);
+		}
 
-		if ((j+1)%18 == 0) {
+		if (!settings.skip_checksums)
 			psx_cdrom_calculate_checksums((psx_cdrom_sector_t *)sector_data, PSX_CDROM_SECTOR_TYPE_MODE2_FORM2);
-			init_sector = 1;
-			lba++;
-		}
+		lba++;
 	}
 
-	return (((j + 17) / 18) * xa_sector_size);
+	return j * xa_sector_size;
 }
 
 void psx_audio_xa_encode_finalize(psx_audio_xa_settings_t settings, uint8_t *output, int output_length) {
@@ -336,6 +1293,10 @@ void psx_audio_xa_encode_finalize(psx_audio_xa_settings_t settings, uint8_t *out
 		psx_cdrom_sector_mode2_t *sector = (psx_cdrom_sector_mode2_t*) &output[output_length - PSX_CDROM_SECTOR_SIZE];
 		sector->subheader[0].submode |= PSX_CDROM_SECTOR_XA_SUBMODE_EOF;
 		psx_audio_xa_sync_subheader_copy(sector);
+
+		// The subheader is covered by the EDC.
+		if (!settings.skip_checksums)
+			psx_cdrom_calculate_checksums((psx_cdrom_sector_t *)sector, PSX_CDROM_SECTOR_TYPE_MODE2_FORM2);
 	}
 }
 
@@ -353,32 +1314,103 @@ int psx_audio_xa_encode_simple(
 	return length;
 }
 
-int psx_audio_spu_encode(
-	psx_audio_encoder_channel_state_t *state,
+// Encodes channel_count channels, each starting at (samples + channel) and
+// spaced pitch samples apart, into separate buffers output_pitch bytes apart.
+static int encode_spu_channels(
+	psx_audio_encoder_settings_t settings,
+	psx_audio_encoder_channel_state_t *states,
+	int channel_count,
 	const int16_t *samples,
 	int sample_count,
 	int pitch,
-	uint8_t *output
+	uint8_t *output,
+	int output_pitch
 ) {
-	uint8_t prebuf[PSX_AUDIO_SPU_SAMPLES_PER_BLOCK];
-	uint8_t *buffer = output;
+	uint8_t prebuf[SIMD_LANES][SPU_BLOCKS_PER_CHUNK * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK];
+	adpcm_block_t blocks[SIMD_LANES * SPU_BLOCKS_PER_CHUNK];
+	int length = 0;
+
+	for (int first_ch = 0; first_ch < channel_count; first_ch += SIMD_LANES) {
+		int group_count = channel_count - first_ch;
+
+		if (group_count > SIMD_LANES)
+			group_count = SIMD_LANES;
+
+		length = 0;
+
+		for (int i = 0; i < sample_count;) {
+			int block_count = (sample_count - i + PSX_AUDIO_SPU_SAMPLES_PER_BLOCK - 1) / PSX_AUDIO_SPU_SAMPLES_PER_BLOCK;
+
+			if (block_count > SPU_BLOCKS_PER_CHUNK)
+				block_count = SPU_BLOCKS_PER_CHUNK;
 
-	for (int i = 0; i < sample_count; i += PSX_AUDIO_SPU_SAMPLES_PER_BLOCK, buffer += PSX_AUDIO_SPU_BLOCK_SIZE) {
-		buffer[0] = encode(state, samples + i * pitch, sample_count - i, pitch, prebuf, 0, 1, SPU_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-		buffer[1] = 0;
+			for (int ch = 0; ch < group_count; ch++) {
+				uint8_t *buffer = output + (first_ch + ch) * output_pitch + length;
 
-		for (int j = 0; j < PSX_AUDIO_SPU_SAMPLES_PER_BLOCK; j+=2) {
-			buffer[2 + (j>>1)] = (prebuf[j] & 0x0F) | (prebuf[j+1] << 4);
+				for (int k = 0; k < block_count; k++) {
+					adpcm_block_t *block = blocks + (ch * block_count + k);
+					int offset = i + k * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK;
+
+					block->samples = samples + offset * pitch + first_ch + ch;
+					block->sample_limit = sample_count - offset;
+					block->data = prebuf[ch] + (k * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK);
+					block->data_shift = 0;
+					block->header = buffer + (k * PSX_AUDIO_SPU_BLOCK_SIZE);
+					block->header[1] = 0;
+				}
+			}
+
+			encode_blocks_interleaved(settings, states + first_ch, blocks, group_count, block_count, pitch, 1, SPU_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
+
+			for (int ch = 0; ch < group_count; ch++) {
+				uint8_t *buffer = output + (first_ch + ch) * output_pitch + length;
+
+				for (int k = 0; k < block_count; k++, buffer += PSX_AUDIO_SPU_BLOCK_SIZE) {
+					const uint8_t *block_prebuf = prebuf[ch] + (k * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK);
+
+					for (int j = 0; j < PSX_AUDIO_SPU_SAMPLES_PER_BLOCK; j+=2) {
+						buffer[2 + (j>>1)] = (block_prebuf[j] & 0x0F) | (block_prebuf[j+1] << 4);
+					}
+				}
+			}
+
+			i += block_count * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK;
+			length += block_count * PSX_AUDIO_SPU_BLOCK_SIZE;
 		}
 	}
 
-	return buffer - output;
+	return length;
+}
+
+int psx_audio_spu_encode(
+	psx_audio_encoder_settings_t settings,
+	psx_audio_encoder_channel_state_t *state,
+	const int16_t *samples,
+	int sample_count,
+	int pitch,
+	uint8_t *output
+) {
+	return encode_spu_channels(settings, state, 1, samples, sample_count, pitch, output, 0);
+}
+
+int psx_audio_spu_encode_interleaved(
+	psx_audio_encoder_settings_t settings,
+	psx_audio_encoder_channel_state_t *states,
+	int channel_count,
+	const int16_t *samples,
+	int sample_count,
+	uint8_t *output,
+	int output_pitch
+) {
+	return encode_spu_channels(settings, states, channel_count, samples, sample_count, channel_count, output, output_pitch);
 }
 
 int psx_audio_spu_encode_simple(const int16_t *samples, int sample_count, uint8_t *output, int loop_start) {
+	psx_audio_encoder_settings_t settings;
 	psx_audio_encoder_channel_state_t state;
+	memset(&settings, 0, sizeof(psx_audio_encoder_settings_t));
 	memset(&state, 0, sizeof(psx_audio_encoder_channel_state_t));
-	int length = psx_audio_spu_encode(&state, samples, sample_count, 1, output);
+	int length = psx_audio_spu_encode(settings, &state, samples, sample_count, 1, output);
 
 	if (length >= PSX_AUDIO_SPU_BLOCK_SIZE) {
 		uint8_t *last_block = output + length - PSX_AUDIO_SPU_BLOCK_SIZE;
@@ -399,3 +1431,343 @@ int psx_audio_spu_encode_simple(const int16_t *samples, int sample_count, uint8_
 
 	return length;
 }
+
+// Stream encoders buffer up to a sector (XA) or chunk (SPU) worth of samples
+// internally, so that samples can be pushed in arbitrarily sized pieces. The
+// most recently encoded sector/chunk is held back until either more data is
+// encoded or the stream is flushed, so that it can be marked as the last one.
+
+struct psx_audio_xa_stream {
+	psx_audio_xa_settings_t settings;
+	psx_audio_encoder_state_t state;
+	psx_audio_stream_callback_t callback;
+	void *context;
+	int lba;
+	int channels;
+	int samples_per_sector;
+	int buffered_samples;
+	int pending_length;
+	int16_t *samples;
+	uint8_t sector[PSX_CDROM_SECTOR_SIZE];
+};
+
+struct psx_audio_spu_stream {
+	psx_audio_encoder_settings_t settings;
+	psx_audio_encoder_channel_state_t state;
+	psx_audio_stream_callback_t callback;
+	void *context;
+	int buffered_samples;
+	int pending_length;
+	int16_t samples[SPU_BLOCKS_PER_CHUNK * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK];
+	uint8_t chunk[SPU_BLOCKS_PER_CHUNK * PSX_AUDIO_SPU_BLOCK_SIZE];
+};
+
+psx_audio_xa_stream_t *psx_audio_xa_stream_create(
+	psx_audio_xa_settings_t settings,
+	int lba,
+	psx_audio_stream_callback_t callback,
+	void *context
+) {
+	psx_audio_xa_stream_t *stream = malloc(sizeof(psx_audio_xa_stream_t));
+
+	if (!stream)
+		return NULL;
+
+	memset(stream, 0, sizeof(psx_audio_xa_stream_t));
+	stream->settings = settings;
+	stream->callback = callback;
+	stream->context = context;
+	stream->lba = lba;
+	stream->channels = settings.stereo ? 2 : 1;
+	stream->samples_per_sector = psx_audio_xa_get_samples_per_sector(settings);
+	stream->samples = malloc(stream->samples_per_sector * stream->channels * sizeof(int16_t));
+
+	if (!stream->samples) {
+		free(stream);
+		return NULL;
+	}
+
+	return stream;
+}
+
+static void xa_stream_encode_sector(psx_audio_xa_stream_t *stream, const int16_t *samples, int sample_count) {
+	if (stream->pending_length)
+		stream->callback(stream->sector, stream->pending_length, false, stream->context);
+
+	memset(stream->sector, 0, PSX_CDROM_SECTOR_SIZE);
+	stream->pending_length = psx_audio_xa_encode(
+		stream->settings,
+		&(stream->state),
+		samples,
+		sample_count,
+		stream->lba,
+		stream->sector
+	);
+	stream->lba++;
+}
+
+void psx_audio_xa_stream_push(psx_audio_xa_stream_t *stream, const int16_t *samples, int sample_count) {
+	int channels = stream->channels;
+
+	// Top up any partially filled sector first, then encode whole sectors
+	// straight from the input and only buffer what is left over.
+	if (stream->buffered_samples) {
+		int length = stream->samples_per_sector - stream->buffered_samples;
+
+		if (length > sample_count)
+			length = sample_count;
+
+		memcpy(
+			stream->samples + stream->buffered_samples * channels,
+			samples,
+			length * channels * sizeof(int16_t)
+		);
+		stream->buffered_samples += length;
+		samples += length * channels;
+		sample_count -= length;
+
+		if (stream->buffered_samples < stream->samples_per_sector)
+			return;
+
+		xa_stream_encode_sector(stream, stream->samples, stream->samples_per_sector);
+		stream->buffered_samples = 0;
+	}
+
+	for (; sample_count >= stream->samples_per_sector; sample_count -= stream->samples_per_sector) {
+		xa_stream_encode_sector(stream, samples, stream->samples_per_sector);
+		samples += stream->samples_per_sector * channels;
+	}
+
+	memcpy(stream->samples, samples, sample_count * channels * sizeof(int16_t));
+	stream->buffered_samples = sample_count;
+}
+
+void psx_audio_xa_stream_flush(psx_audio_xa_stream_t *stream) {
+	if (stream->buffered_samples) {
+		xa_stream_encode_sector(stream, stream->samples, stream->buffered_samples);
+		stream->buffered_samples = 0;
+	}
+	if (stream->pending_length) {
+		psx_audio_xa_encode_finalize(stream->settings, stream->sector, stream->pending_length);
+		stream->callback(stream->sector, stream->pending_length, true, stream->context);
+		stream->pending_length = 0;
+	}
+}
+
+void psx_audio_xa_stream_destroy(psx_audio_xa_stream_t *stream) {
+	free(stream->samples);
+	free(stream);
+}
+
+psx_audio_spu_stream_t *psx_audio_spu_stream_create(
+	psx_audio_encoder_settings_t settings,
+	psx_audio_stream_callback_t callback,
+	void *context
+) {
+	psx_audio_spu_stream_t *stream = malloc(sizeof(psx_audio_spu_stream_t));
+
+	if (!stream)
+		return NULL;
+
+	memset(stream, 0, sizeof(psx_audio_spu_stream_t));
+	stream->settings = settings;
+	stream->callback = callback;
+	stream->context = context;
+	return stream;
+}
+
+static void spu_stream_encode_chunk(psx_audio_spu_stream_t *stream, const int16_t *samples, int sample_count) {
+	if (stream->pending_length)
+		stream->callback(stream->chunk, stream->pending_length, false, stream->context);
+
+	stream->pending_length = encode_spu_channels(
+		stream->settings,
+		&(stream->state),
+		1,
+		samples,
+		sample_count,
+		1,
+		stream->chunk,
+		0
+	);
+}
+
+void psx_audio_spu_stream_push(psx_audio_spu_stream_t *stream, const int16_t *samples, int sample_count) {
+	const int samples_per_chunk = SPU_BLOCKS_PER_CHUNK * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK;
+
+	if (stream->buffered_samples) {
+		int length = samples_per_chunk - stream->buffered_samples;
+
+		if (length > sample_count)
+			length = sample_count;
+
+		memcpy(stream->samples + stream->buffered_samples, samples, length * sizeof(int16_t));
+		stream->buffered_samples += length;
+		samples += length;
+		sample_count -= length;
+
+		if (stream->buffered_samples < samples_per_chunk)
+			return;
+
+		spu_stream_encode_chunk(stream, stream->samples, samples_per_chunk);
+		stream->buffered_samples = 0;
+	}
+
+	for (; sample_count >= samples_per_chunk; sample_count -= samples_per_chunk) {
+		spu_stream_encode_chunk(stream, samples, samples_per_chunk);
+		samples += samples_per_chunk;
+	}
+
+	memcpy(stream->samples, samples, sample_count * sizeof(int16_t));
+	stream->buffered_samples = sample_count;
+}
+
+void psx_audio_spu_stream_flush(psx_audio_spu_stream_t *stream) {
+	if (stream->buffered_samples) {
+		spu_stream_encode_chunk(stream, stream->samples, stream->buffered_samples);
+		stream->buffered_samples = 0;
+	}
+	if (stream->pending_length) {
+		stream->callback(stream->chunk, stream->pending_length, true, stream->context);
+		stream->pending_length = 0;
+	}
+}
+
+void psx_audio_spu_stream_destroy(psx_audio_spu_stream_t *stream) {
+	free(stream);
+}
+
+// Runs the prediction filter over a block of unpacked and scaled samples,
+// exactly the way the encoder predicts the decoder's output (which in turn
+// matches the SPU and CD-ROM hardware).
+static void decode_block(
+	psx_audio_decoder_channel_state_t *state,
+	const int32_t *values,
+	int filter,
+	int16_t *output,
+	int pitch
+) {
+	int k1 = filter_k1[(filter < ADPCM_FILTER_COUNT) ? filter : (ADPCM_FILTER_COUNT - 1)];
+	int k2 = filter_k2[(filter < ADPCM_FILTER_COUNT) ? filter : (ADPCM_FILTER_COUNT - 1)];
+	int prev1 = state->prev1;
+	int prev2 = state->prev2;
+
+	for (int i = 0; i < PSX_AUDIO_SPU_SAMPLES_PER_BLOCK; i++) {
+		int sample = values[i] + ((k1 * prev1 + k2 * prev2 + (1 << 5)) >> 6);
+		if (sample < -0x8000) { sample = -0x8000; }
+		if (sample > +0x7FFF) { sample = +0x7FFF; }
+
+		output[i * pitch] = (int16_t)sample;
+		prev2 = prev1;
+		prev1 = sample;
+	}
+
+	state->prev1 = prev1;
+	state->prev2 = prev2;
+}
+
+// Unpacking the samples does not depend on previous ones, so it is done
+// separately from filtering in loops the compiler can vectorize. Samples are
+// sign extended by shifting them into the top bits first.
+static void decode_block_xa(
+	psx_audio_decoder_channel_state_t *state,
+	uint8_t header,
+	const uint8_t *data,
+	int data_shift,
+	int shift_range,
+	int16_t *output,
+	int pitch
+) {
+	int32_t values[PSX_AUDIO_SPU_SAMPLES_PER_BLOCK];
+	int sample_shift = header & 0x0F;
+	int sign_shift = 32 - (16 - shift_range);
+
+	for (int i = 0; i < PSX_AUDIO_SPU_SAMPLES_PER_BLOCK; i++) {
+		uint32_t sample = data[i * 4] >> data_shift;
+
+		values[i] = (((int32_t)(sample << sign_shift) >> sign_shift) * (1 << shift_range)) >> sample_shift;
+	}
+
+	decode_block(state, values, header >> 4, output, pitch);
+}
+
+static void decode_block_spu(
+	psx_audio_decoder_channel_state_t *state,
+	const uint8_t *block,
+	int16_t *output,
+	int pitch
+) {
+	int32_t values[PSX_AUDIO_SPU_SAMPLES_PER_BLOCK];
+	int sample_shift = block[0] & 0x0F;
+
+	for (int i = 0; i < PSX_AUDIO_SPU_SAMPLES_PER_BLOCK; i++) {
+		uint32_t sample = block[2 + (i >> 1)] >> ((i & 1) * 4);
+
+		values[i] = ((int32_t)(sample << 28) >> 16) >> sample_shift;
+	}
+
+	decode_block(state, values, block[0] >> 4, output, pitch);
+}
+
+int psx_audio_xa_decode(
+	psx_audio_xa_settings_t settings,
+	psx_audio_decoder_state_t *state,
+	const uint8_t *input,
+	int input_length,
+	int16_t *output
+) {
+	int shift_range = (settings.bits_per_sample == 8) ? SHIFT_RANGE_8BPS : SHIFT_RANGE_4BPS;
+	int block_count = (settings.bits_per_sample == 8) ? 4 : 8;
+	int pitch = settings.stereo ? 2 : 1;
+	int xa_sector_size = psx_audio_xa_get_buffer_size_per_sector(settings);
+	int xa_offset = PSX_CDROM_SECTOR_SIZE - xa_sector_size;
+	int length = 0;
+
+	for (int j = 0; j < input_length / xa_sector_size; j++) {
+		const psx_cdrom_sector_mode2_t *sector_data = (const psx_cdrom_sector_mode2_t*) (input + (j * xa_sector_size) - xa_offset);
+
+		for (int k = 0; k < 18; k++) {
+			const uint8_t *data = sector_data->data + (k * 0x80);
+
+			for (int i = 0; i < block_count; i++) {
+				psx_audio_decoder_channel_state_t *channel_state = &(state->left);
+				int16_t *block_output = output;
+
+				if (settings.stereo) {
+					if (i & 1)
+						channel_state = &(state->right);
+
+					block_output += (length + (i >> 1) * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK) * 2 + (i & 1);
+				} else {
+					block_output += length + i * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK;
+				}
+
+				if (settings.bits_per_sample == 4)
+					decode_block_xa(channel_state, data[xa_header_offsets[i]], data + 0x10 + (i >> 1), (i & 1) * 4, shift_range, block_output, pitch);
+				else
+					decode_block_xa(channel_state, data[xa_header_offsets[i]], data + 0x10 + i, 0, shift_range, block_output, pitch);
+			}
+
+			length += (block_count / pitch) * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK;
+		}
+	}
+
+	return length;
+}
+
+int psx_audio_spu_decode(
+	psx_audio_decoder_channel_state_t *state,
+	const uint8_t *input,
+	int input_length,
+	int pitch,
+	int16_t *output
+) {
+	int length = 0;
+
+	for (int i = 0; i < input_length / PSX_AUDIO_SPU_BLOCK_SIZE; i++, input += PSX_AUDIO_SPU_BLOCK_SIZE) {
+		decode_block_spu(state, input, output + length * pitch, pitch);
+		length += PSX_AUDIO_SPU_SAMPLES_PER_BLOCK;
+	}
+
+	return length;
+}
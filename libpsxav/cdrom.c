@@ -21,25 +21,261 @@ freely, subject to the following restrictions:
 3. This notice may not be removed or altered from any source distribution.
 */
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 #include "libpsxav.h"
 
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define CDROM_USE_X86_SIMD
+#include <immintrin.h>
+#endif
+
 #define EDC_CRC32_POLYNOMIAL 0xD8018001
 
-static uint32_t edc_crc32(uint8_t *data, int length) {
-	uint32_t edc = 0;
+// The EDC is computed 8 bytes at a time ("slice-by-8"). Table n holds the
+// effect of each byte value on the CRC once it is followed by n more bytes.
+static uint32_t edc_tables[8][256];
+
+// ECC uses a Reed-Solomon product code over GF(2^8). ecc_f_table multiplies
+// each value by alpha (i.e. 2) and ecc_b_table divides it by (alpha + 1).
+static uint8_t ecc_f_table[256];
+static uint8_t ecc_b_table[256];
 
-	for (int i = 0; i < length; i++) {
-		edc ^= 0xFF & (uint32_t)data[i];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void init_tables(void) {
+	for (int i = 0; i < 256; i++) {
+		uint32_t edc = i;
 
 		for (int j = 0; j < 8; j++)
 			edc = (edc >> 1) ^ (EDC_CRC32_POLYNOMIAL * (edc & 0x1));
+
+		edc_tables[0][i] = edc;
 	}
 
+	for (int n = 1; n < 8; n++) {
+		for (int i = 0; i < 256; i++) {
+			uint32_t edc = edc_tables[n - 1][i];
+
+			edc_tables[n][i] = (edc >> 8) ^ edc_tables[0][edc & 0xFF];
+		}
+	}
+
+	for (int i = 0; i < 256; i++) {
+		int j = (i << 1) ^ ((i & 0x80) ? 0x11D : 0);
+
+		ecc_f_table[i] = j;
+		ecc_b_table[i ^ j] = i;
+	}
+}
+
+static uint32_t edc_crc32_tables(uint32_t edc, const uint8_t *data, int length) {
+	for (; length >= 8; length -= 8, data += 8) {
+		uint32_t lo = edc ^ (
+			(uint32_t)data[0] |
+			((uint32_t)data[1] << 8) |
+			((uint32_t)data[2] << 16) |
+			((uint32_t)data[3] << 24)
+		);
+		uint32_t hi =
+			(uint32_t)data[4] |
+			((uint32_t)data[5] << 8) |
+			((uint32_t)data[6] << 16) |
+			((uint32_t)data[7] << 24);
+
+		edc =
+			edc_tables[7][lo & 0xFF] ^
+			edc_tables[6][(lo >> 8) & 0xFF] ^
+			edc_tables[5][(lo >> 16) & 0xFF] ^
+			edc_tables[4][lo >> 24] ^
+			edc_tables[3][hi & 0xFF] ^
+			edc_tables[2][(hi >> 8) & 0xFF] ^
+			edc_tables[1][(hi >> 16) & 0xFF] ^
+			edc_tables[0][hi >> 24];
+	}
+
+	for (; length > 0; length--, data++)
+		edc = (edc >> 8) ^ edc_tables[0][(edc ^ *data) & 0xFF];
+
 	return edc;
 }
 
+#ifdef CDROM_USE_X86_SIMD
+// Folds 64 bytes at a time into four 128-bit accumulators using carry-less
+// multiplication, then folds those into one. The constants are x^(512+32),
+// x^(512-32), x^(128+32) and x^(128-32) modulo the EDC polynomial, bit
+// reflected and shifted left by one. Rather than doing a Barrett reduction,
+// the last accumulator is stored and run through the tables along with any
+// leftover bytes, which gives the same result.
+#define EDC_FOLD_512_LO 0x1F8931102
+#define EDC_FOLD_512_HI 0x12E7928A2
+#define EDC_FOLD_128_LO 0x06C90C100
+#define EDC_FOLD_128_HI 0x1D5934102
+
+__attribute__((target("sse2,pclmul")))
+static inline __m128i edc_fold(__m128i value, __m128i constants, __m128i next) {
+	return _mm_xor_si128(
+		_mm_xor_si128(
+			_mm_clmulepi64_si128(value, constants, 0x00),
+			_mm_clmulepi64_si128(value, constants, 0x11)
+		),
+		next
+	);
+}
+
+__attribute__((target("sse2,pclmul")))
+static uint32_t edc_crc32_pclmul(const uint8_t *data, int length) {
+	const __m128i fold_512 = _mm_set_epi64x(EDC_FOLD_512_HI, EDC_FOLD_512_LO);
+	const __m128i fold_128 = _mm_set_epi64x(EDC_FOLD_128_HI, EDC_FOLD_128_LO);
+
+	__m128i x0 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+	__m128i x1 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+	__m128i x2 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+	__m128i x3 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+
+	for (data += 64, length -= 64; length >= 64; data += 64, length -= 64) {
+		x0 = edc_fold(x0, fold_512, _mm_loadu_si128((const __m128i *)(data + 0x00)));
+		x1 = edc_fold(x1, fold_512, _mm_loadu_si128((const __m128i *)(data + 0x10)));
+		x2 = edc_fold(x2, fold_512, _mm_loadu_si128((const __m128i *)(data + 0x20)));
+		x3 = edc_fold(x3, fold_512, _mm_loadu_si128((const __m128i *)(data + 0x30)));
+	}
+
+	x1 = edc_fold(x0, fold_128, x1);
+	x2 = edc_fold(x1, fold_128, x2);
+	x3 = edc_fold(x2, fold_128, x3);
+
+	for (; length >= 16; data += 16, length -= 16)
+		x3 = edc_fold(x3, fold_128, _mm_loadu_si128((const __m128i *)data));
+
+	uint8_t folded[16];
+	_mm_storeu_si128((__m128i *)folded, x3);
+
+	return edc_crc32_tables(edc_crc32_tables(0, folded, 16), data, length);
+}
+#endif
+
+static uint32_t edc_crc32(const uint8_t *data, int length) {
+#ifdef CDROM_USE_X86_SIMD
+	if (length >= 64 && __builtin_cpu_supports("pclmul"))
+		return edc_crc32_pclmul(data, length);
+#endif
+
+	return edc_crc32_tables(0, data, length);
+}
+
+// ECC is computed over the header and user data (plus the EDC and P parity
+// for Q) starting at offset 0xC, read as 16-bit words split into two
+// interleaved byte planes. Each of the major_count parity pairs covers
+// minor_count bytes, spaced minor_step bytes apart and wrapping around.
+// P parity covers the columns of a 43x24 word matrix and Q parity its
+// diagonals.
+#define ECC_P_MAJOR_COUNT 86
+#define ECC_P_MINOR_COUNT 24
+#define ECC_Q_MAJOR_COUNT 52
+#define ECC_Q_MINOR_COUNT 43
+
+static inline uint8_t ecc_finish(uint8_t ecc_a, uint8_t ecc_b) {
+	return ecc_b_table[ecc_f_table[ecc_a] ^ ecc_b];
+}
+
+static void ecc_compute_block(
+	const uint8_t *src,
+	int major_count,
+	int minor_count,
+	int major_step,
+	int minor_step,
+	uint8_t *dest
+) {
+	int size = major_count * minor_count;
+
+	for (int major = 0; major < major_count; major++) {
+		int index = (major >> 1) * major_step + (major & 1);
+		uint8_t ecc_a = 0;
+		uint8_t ecc_b = 0;
+
+		for (int minor = 0; minor < minor_count; minor++) {
+			uint8_t value = src[index];
+
+			index += minor_step;
+			if (index >= size) { index -= size; }
+
+			ecc_a = ecc_f_table[ecc_a ^ value];
+			ecc_b ^= value;
+		}
+
+		ecc_a = ecc_finish(ecc_a, ecc_b);
+		dest[major] = ecc_a;
+		dest[major + major_count] = ecc_a ^ ecc_b;
+	}
+}
+
+#ifdef CDROM_USE_X86_SIMD
+// All bytes covered by each P parity pair lie in the same column of 86-byte
+// rows, so 16 columns can be processed at a time. Multiplying by alpha is a
+// shift plus a conditional XOR with the low byte of the field polynomial. The
+// last chunk overlaps the previous one to cover the remaining 6 columns.
+__attribute__((target("sse2")))
+static void ecc_compute_p_sse2(const uint8_t *src, uint8_t *dest) {
+	const __m128i poly = _mm_set1_epi8(0x1D);
+	uint8_t ecc_a[ECC_P_MAJOR_COUNT];
+	uint8_t ecc_b[ECC_P_MAJOR_COUNT];
+
+	for (int offset = 0; offset < ECC_P_MAJOR_COUNT; offset += 16) {
+		if (offset > ECC_P_MAJOR_COUNT - 16)
+			offset = ECC_P_MAJOR_COUNT - 16;
+
+		__m128i a = _mm_setzero_si128();
+		__m128i b = _mm_setzero_si128();
+
+		for (int minor = 0; minor < ECC_P_MINOR_COUNT; minor++) {
+			__m128i value = _mm_loadu_si128((const __m128i *)(src + minor * ECC_P_MAJOR_COUNT + offset));
+
+			a = _mm_xor_si128(a, value);
+			b = _mm_xor_si128(b, value);
+			a = _mm_xor_si128(
+				_mm_add_epi8(a, a),
+				_mm_and_si128(_mm_cmplt_epi8(a, _mm_setzero_si128()), poly)
+			);
+		}
+
+		_mm_storeu_si128((__m128i *)(ecc_a + offset), a);
+		_mm_storeu_si128((__m128i *)(ecc_b + offset), b);
+	}
+
+	for (int major = 0; major < ECC_P_MAJOR_COUNT; major++) {
+		uint8_t value = ecc_finish(ecc_a[major], ecc_b[major]);
+
+		dest[major] = value;
+		dest[major + ECC_P_MAJOR_COUNT] = value ^ ecc_b[major];
+	}
+}
+#endif
+
+// Mode 2 sectors are protected as if their header was all zeroes, so that the
+// data can be relocated without regenerating ECC.
+static void ecc_generate(uint8_t *data, bool zero_header) {
+	uint8_t header[4];
+
+	if (zero_header) {
+		memcpy(header, data + 0xC, 4);
+		memset(data + 0xC, 0, 4);
+	}
+
+#ifdef CDROM_USE_X86_SIMD
+	if (__builtin_cpu_supports("sse2"))
+		ecc_compute_p_sse2(data + 0xC, data + 0x81C);
+	else
+#endif
+		ecc_compute_block(data + 0xC, ECC_P_MAJOR_COUNT, ECC_P_MINOR_COUNT, 2, ECC_P_MAJOR_COUNT, data + 0x81C);
+
+	ecc_compute_block(data + 0xC, ECC_Q_MAJOR_COUNT, ECC_Q_MINOR_COUNT, ECC_P_MAJOR_COUNT, ECC_P_MAJOR_COUNT + 2, data + 0x8C8);
+
+	if (zero_header)
+		memcpy(data + 0xC, header, 4);
+}
+
 #define TO_BCD(x) ((x) + ((x) / 10) * 6)
 
 void psx_cdrom_init_xa_subheader(psx_cdrom_sector_xa_subheader_t *subheader, psx_cdrom_sector_type_t type) {
@@ -77,6 +313,8 @@ void psx_cdrom_calculate_checksums(psx_cdrom_sector_t *sector, psx_cdrom_sector_
 	uint8_t *data = (uint8_t *)sector;
 	uint32_t edc;
 
+	pthread_once(&tables_once, &init_tables);
+
 	switch (type) {
 		case PSX_CDROM_SECTOR_TYPE_MODE1:
 			edc = edc_crc32(data, 0x810);
@@ -85,8 +323,8 @@ void psx_cdrom_calculate_checksums(psx_cdrom_sector_t *sector, psx_cdrom_sector_
 			data[0x811] = (uint8_t)(edc >> 8);
 			data[0x812] = (uint8_t)(edc >> 16);
 			data[0x813] = (uint8_t)(edc >> 24);
-			memset(sector + 0x814, 0, 8);
-			// TODO: ECC
+			memset(data + 0x814, 0, 8);
+			ecc_generate(data, false);
 			break;
 
 		case PSX_CDROM_SECTOR_TYPE_MODE2_FORM1:
@@ -96,7 +334,7 @@ void psx_cdrom_calculate_checksums(psx_cdrom_sector_t *sector, psx_cdrom_sector_
 			data[0x819] = (uint8_t)(edc >> 8);
 			data[0x81A] = (uint8_t)(edc >> 16);
 			data[0x81B] = (uint8_t)(edc >> 24);
-			// TODO: ECC
+			ecc_generate(data, true);
 			break;
 
 		case PSX_CDROM_SECTOR_TYPE_MODE2_FORM2:
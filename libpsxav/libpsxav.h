@@ -31,6 +31,8 @@ freely, subject to the following restrictions:
 #define PSX_AUDIO_SPU_BLOCK_SIZE        16
 #define PSX_AUDIO_SPU_SAMPLES_PER_BLOCK 28
 
+#define PSX_AUDIO_NOISE_SHAPING_MAX_ORDER 3
+
 enum {
 	PSX_AUDIO_XA_FREQ_SINGLE = 18900,
 	PSX_AUDIO_XA_FREQ_DOUBLE = 37800
@@ -41,6 +43,19 @@ typedef enum {
 	PSX_AUDIO_XA_FORMAT_XACD // 2352-byte sector
 } psx_audio_xa_format_t;
 
+// Presets control how many filter/shift combinations are tried for each block.
+typedef enum {
+	PSX_AUDIO_ENCODER_PRESET_DEFAULT, // estimated shift and the ones next to it
+	PSX_AUDIO_ENCODER_PRESET_FAST, // estimated shift only
+	PSX_AUDIO_ENCODER_PRESET_EXHAUSTIVE // every possible shift
+} psx_audio_encoder_preset_t;
+
+typedef struct {
+	psx_audio_encoder_preset_t preset;
+	int beam_width; // number of candidate paths kept per channel, 1 or less for greedy encoding
+	int noise_shaping_order; // 0 (disabled) to PSX_AUDIO_NOISE_SHAPING_MAX_ORDER
+} psx_audio_encoder_settings_t;
+
 typedef struct {
 	psx_audio_xa_format_t format;
 	bool stereo; // false or true
@@ -48,12 +63,15 @@ typedef struct {
 	int bits_per_sample; // 4 or 8
 	int file_number; // 00-FF
 	int channel_number; // 00-1F
+	bool skip_checksums; // leave EDC calculation to the caller
+	psx_audio_encoder_settings_t encoder;
 } psx_audio_xa_settings_t;
 
 typedef struct {
-	int qerr; // quanitisation error
+	int qerr[PSX_AUDIO_NOISE_SHAPING_MAX_ORDER]; // quantization error history, most recent first
 	uint64_t mse; // mean square error
 	int prev1, prev2;
+	int prev_filter, prev_sample_shift; // used as a hint for the next block
 } psx_audio_encoder_channel_state_t;
 
 typedef struct {
@@ -61,6 +79,15 @@ typedef struct {
 	psx_audio_encoder_channel_state_t right;
 } psx_audio_encoder_state_t;
 
+typedef struct {
+	int prev1, prev2;
+} psx_audio_decoder_channel_state_t;
+
+typedef struct {
+	psx_audio_decoder_channel_state_t left;
+	psx_audio_decoder_channel_state_t right;
+} psx_audio_decoder_state_t;
+
 enum {
 	PSX_AUDIO_SPU_LOOP_END    = (1 << 0),
 	PSX_AUDIO_SPU_LOOP_REPEAT = (1 << 0) | (1 << 1),
@@ -91,14 +118,66 @@ int psx_audio_xa_encode_simple(
 	uint8_t *output
 );
 int psx_audio_spu_encode(
+	psx_audio_encoder_settings_t settings,
 	psx_audio_encoder_channel_state_t *state,
 	const int16_t *samples,
 	int sample_count,
 	int pitch,
 	uint8_t *output
 );
+int psx_audio_spu_encode_interleaved(
+	psx_audio_encoder_settings_t settings,
+	psx_audio_encoder_channel_state_t *states,
+	int channel_count,
+	const int16_t *samples,
+	int sample_count,
+	uint8_t *output,
+	int output_pitch
+);
 int psx_audio_spu_encode_simple(const int16_t *samples, int sample_count, uint8_t *output, int loop_start);
 void psx_audio_xa_encode_finalize(psx_audio_xa_settings_t settings, uint8_t *output, int output_length);
+int psx_audio_xa_decode(
+	psx_audio_xa_settings_t settings,
+	psx_audio_decoder_state_t *state,
+	const uint8_t *input,
+	int input_length,
+	int16_t *output
+);
+int psx_audio_spu_decode(
+	psx_audio_decoder_channel_state_t *state,
+	const uint8_t *input,
+	int input_length,
+	int pitch,
+	int16_t *output
+);
+
+// Stream encoders accept any number of samples at a time (interleaved if
+// stereo) and pass each encoded sector (XA) or group of blocks (SPU) to the
+// callback, which may alter the data before consuming it. The last sector or
+// group of blocks is only emitted once the stream is flushed, with last set to
+// true; XA streams also mark it with the EOF flag.
+
+typedef struct psx_audio_xa_stream psx_audio_xa_stream_t;
+typedef struct psx_audio_spu_stream psx_audio_spu_stream_t;
+typedef void (*psx_audio_stream_callback_t)(uint8_t *data, int length, bool last, void *context);
+
+psx_audio_xa_stream_t *psx_audio_xa_stream_create(
+	psx_audio_xa_settings_t settings,
+	int lba,
+	psx_audio_stream_callback_t callback,
+	void *context
+);
+void psx_audio_xa_stream_push(psx_audio_xa_stream_t *stream, const int16_t *samples, int sample_count);
+void psx_audio_xa_stream_flush(psx_audio_xa_stream_t *stream);
+void psx_audio_xa_stream_destroy(psx_audio_xa_stream_t *stream);
+psx_audio_spu_stream_t *psx_audio_spu_stream_create(
+	psx_audio_encoder_settings_t settings,
+	psx_audio_stream_callback_t callback,
+	void *context
+);
+void psx_audio_spu_stream_push(psx_audio_spu_stream_t *stream, const int16_t *samples, int sample_count);
+void psx_audio_spu_stream_flush(psx_audio_spu_stream_t *stream);
+void psx_audio_spu_stream_destroy(psx_audio_spu_stream_t *stream);
 
 // cdrom.c
 
@@ -130,6 +130,14 @@ static const char *const general_options_help =
 	"                        sbs:    [.V] .sbs video\n"
 	"    -R key=value,...  Pass custom options to libswresample (see FFmpeg docs)\n"
 	"    -S key=value,...  Pass custom options to libswscale (see FFmpeg docs)\n"
+	"    -j threads        Split audio into segments encoded in parallel (xa/xacd/spu/vag),\n"
+	"                      encode this many video frames ahead in parallel (str/strcd/strv)\n"
+	"                      or split each frame into this many column stripes (sbs); default 1\n"
+	"    -B lba            Place first sector at specified LBA when generating sector headers (xacd/strcd only, default 0)\n"
+	"    -O name           Write sectors into a Mode 2 .bin disc image at the LBA given by -B (xacd/strcd only);\n"
+	"                      the file is added to the image's ISO9660 root directory under given name (new images get a\n"
+	"                      minimal volume) and a .cue sheet is written if there is none\n"
+	"    -e                Decode audio after encoding and report signal-to-noise ratio and peak error (audio-only formats)\n"
 	"\n";
 
 static const char *const format_names[NUM_FORMATS] = {
@@ -167,6 +175,9 @@ static void init_default_args(args_t *args) {
 	args->audio_xa_channel = 0;
 	args->audio_interleave = 2048;
 	args->audio_loop_point = -1;
+	args->audio_preset = AUDIO_PRESET_DEFAULT;
+	args->audio_beam_width = 1;
+	args->audio_noise_shaping = 0;
 
 	args->video_codec = BS_CODEC_V2;
 	args->video_width = 320;
@@ -230,20 +241,55 @@ static int parse_general_option(args_t *args, char option, const char *param) {
 			args->swscale_options = param;
 			return 2;
 
+		case 'j':
+			return parse_int(&(args->threads), "thread count", param, 1, 256);
+
+		case 'e':
+			args->flags |= FLAG_VERIFY_AUDIO;
+			return 1;
+
+		case 'B':
+			return parse_int(&(args->base_lba), "base LBA", param, 0, -1);
+
+		case 'O':
+			if (param == NULL) {
+				fprintf(stderr, "Missing disc image file name after option\n");
+				return INVALID_PARAM;
+			}
+			if (strlen(param) > 30) {
+				fprintf(stderr, "Invalid disc image file name: %s (must be at most 30 characters long)\n", param);
+				return INVALID_PARAM;
+			}
+
+			args->image_file_name = param;
+			return 2;
+
 		default:
 			return 0;
 	}
 }
 
+static const char *const audio_preset_names[NUM_AUDIO_PRESETS] = {
+	"fast",
+	"default",
+	"exhaustive"
+};
+
 static const char *const xa_options_help =
 	"XA-ADPCM options:\n"
-	"    [-f 18900|37800] [-c 1|2] [-b 4|8] [-F 0-255] [-C 0-31]\n"
+	"    [-f 18900|37800] [-c 1|2] [-b 4|8] [-F 0-255] [-C 0-31] [-P preset] [-K 1-64] [-N 0-3]\n"
 	"\n"
 	"    -f 18900|37800    Use specified sample rate (default 37800)\n"
 	"    -c 1|2            Use specified channel count (default 2)\n"
 	"    -b 4|8            Use specified bit depth (default 4)\n"
 	"    -F 0-255          Set CD-XA file number (for both audio and video, default 0)\n"
 	"    -C 0-31           Set CD-XA channel number (for both audio and video, default 0)\n"
+	"    -P preset         Use specified encoding speed/quality tradeoff\n"
+	"                        fast:       try one shift per filter\n"
+	"                        default:    try shifts close to the estimated best one (default)\n"
+	"                        exhaustive: try every shift (slowest)\n"
+	"    -K 1-64           Search for best encoding using specified number of candidates per channel (slower, default 1)\n"
+	"    -N 0-3            Shape quantization noise towards higher frequencies using filter of specified order (default 0)\n"
 	"\n";
 
 static int parse_xa_option(args_t *args, char option, const char *param) {
@@ -263,6 +309,15 @@ static int parse_xa_option(args_t *args, char option, const char *param) {
 		case 'C':
 			return parse_int(&(args->audio_xa_channel), "channel number", param, 0, 31);
 
+		case 'P':
+			return parse_enum(&(args->audio_preset), "encoder preset", param, audio_preset_names, NUM_AUDIO_PRESETS);
+
+		case 'K':
+			return parse_int(&(args->audio_beam_width), "candidate count", param, 1, 64);
+
+		case 'N':
+			return parse_int(&(args->audio_noise_shaping), "noise shaping order", param, 0, 3);
+
 		default:
 			return 0;
 	}
@@ -270,7 +325,7 @@ static int parse_xa_option(args_t *args, char option, const char *param) {
 
 static const char *const spu_options_help =
 	"Mono SPU-ADPCM options:\n"
-	"    [-f freq] [-a size] [-l ms | -n | -L] [-D]\n"
+	"    [-f freq] [-a size] [-l ms | -n | -L] [-D] [-P preset] [-K 1-64] [-N 0-3]\n"
 	"\n"
 	"    -f freq           Use specified sample rate (default 44100)\n"
 	"    -a size           Pad audio data excluding header to multiple of given size (default 64)\n"
@@ -278,6 +333,12 @@ static const char *const spu_options_help =
 	"    -n                Do not set loop end flag nor add a loop point (even if input file has one)\n"
 	"    -L                Set ADPCM loop end flag at end of data but do not add a loop point (even if input file has one)\n"
 	"    -D                Do not prepend encoded data with a dummy silent block to reset decoder state\n"
+	"    -P preset         Use specified encoding speed/quality tradeoff\n"
+	"                        fast:       try one shift per filter\n"
+	"                        default:    try shifts close to the estimated best one (default)\n"
+	"                        exhaustive: try every shift (slowest)\n"
+	"    -K 1-64           Search for best encoding using specified number of candidates (slower, default 1)\n"
+	"    -N 0-3            Shape quantization noise towards higher frequencies using filter of specified order (default 0)\n"
 	"\n";
 
 static int parse_spu_option(args_t *args, char option, const char *param) {
@@ -306,6 +367,15 @@ static int parse_spu_option(args_t *args, char option, const char *param) {
 			args->flags |= FLAG_SPU_NO_LEADING_DUMMY;
 			return 1;
 
+		case 'P':
+			return parse_enum(&(args->audio_preset), "encoder preset", param, audio_preset_names, NUM_AUDIO_PRESETS);
+
+		case 'K':
+			return parse_int(&(args->audio_beam_width), "candidate count", param, 1, 64);
+
+		case 'N':
+			return parse_int(&(args->audio_noise_shaping), "noise shaping order", param, 0, 3);
+
 		default:
 			return 0;
 	}
@@ -313,7 +383,7 @@ static int parse_spu_option(args_t *args, char option, const char *param) {
 
 static const char *const spui_options_help =
 	"Interleaved SPU-ADPCM options:\n"
-	"    [-f freq] [-c channels] [-i size] [-a size] [-l ms | -n] [-L] [-D]\n"
+	"    [-f freq] [-c channels] [-i size] [-a size] [-l ms | -n] [-L] [-D] [-P preset] [-K 1-64] [-N 0-3]\n"
 	"\n"
 	"    -f freq           Use specified sample rate (default 44100)\n"
 	"    -c channels       Use specified channel count (default 2)\n"
@@ -323,6 +393,12 @@ static const char *const spui_options_help =
 	"    -n                Do not store any loop point in file header (even if input file has one)\n"
 	"    -L                Set ADPCM loop end flag at the end of each audio chunk (separately from loop point in file header)\n"
 	"    -D                Do not prepend first chunk's data with a dummy silent block to reset decoder state\n"
+	"    -P preset         Use specified encoding speed/quality tradeoff\n"
+	"                        fast:       try one shift per filter\n"
+	"                        default:    try shifts close to the estimated best one (default)\n"
+	"                        exhaustive: try every shift (slowest)\n"
+	"    -K 1-64           Search for best encoding using specified number of candidates per channel (slower, default 1)\n"
+	"    -N 0-3            Shape quantization noise towards higher frequencies using filter of specified order (default 0)\n"
 	"\n";
 
 static int parse_spui_option(args_t *args, char option, const char *param) {
@@ -362,6 +438,15 @@ static int parse_spui_option(args_t *args, char option, const char *param) {
 			args->flags |= FLAG_SPU_NO_LEADING_DUMMY;
 			return 1;
 
+		case 'P':
+			return parse_enum(&(args->audio_preset), "encoder preset", param, audio_preset_names, NUM_AUDIO_PRESETS);
+
+		case 'K':
+			return parse_int(&(args->audio_beam_width), "candidate count", param, 1, 64);
+
+		case 'N':
+			return parse_int(&(args->audio_noise_shaping), "noise shaping order", param, 0, 3);
+
 		default:
 			return 0;
 	}
@@ -732,6 +817,14 @@ bool parse_args(args_t *args, const char *const *options, int count) {
 		);
 		return false;
 	}
+	if (
+		(args->base_lba || args->image_file_name != NULL) &&
+		args->format != FORMAT_XACD &&
+		args->format != FORMAT_STRCD
+	) {
+		fprintf(stderr, "Sector placement options are only supported for xacd and strcd formats\n");
+		return false;
+	}
 
 	return true;
 }
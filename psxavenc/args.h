@@ -28,6 +28,7 @@ freely, subject to the following restrictions:
 
 #define NUM_FORMATS   11
 #define NUM_BS_CODECS 3
+#define NUM_AUDIO_PRESETS 3
 
 enum {
 	FLAG_IGNORE_OPTIONS       = 1 << 0,
@@ -39,7 +40,8 @@ enum {
 	FLAG_SPU_ENABLE_LOOP      = 1 << 6,
 	FLAG_SPU_NO_LEADING_DUMMY = 1 << 7,
 	FLAG_BS_IGNORE_ASPECT     = 1 << 8,
-	FLAG_STR_TRAILING_AUDIO   = 1 << 9
+	FLAG_STR_TRAILING_AUDIO   = 1 << 9,
+	FLAG_VERIFY_AUDIO         = 1 << 10
 };
 
 typedef enum {
@@ -64,6 +66,13 @@ typedef enum {
 	BS_CODEC_V3DC
 } bs_codec_t;
 
+typedef enum {
+	AUDIO_PRESET_INVALID = -1,
+	AUDIO_PRESET_FAST,
+	AUDIO_PRESET_DEFAULT,
+	AUDIO_PRESET_EXHAUSTIVE
+} audio_preset_t;
+
 typedef struct {
 	int flags;
 
@@ -72,6 +81,9 @@ typedef struct {
 	const char *output_file;
 	const char *swresample_options;
 	const char *swscale_options;
+	int threads;
+	int base_lba;
+	const char *image_file_name;
 
 	int audio_frequency; // 18900 or 37800 Hz
 	int audio_channels;
@@ -80,6 +92,9 @@ typedef struct {
 	int audio_xa_channel; // 00-1F
 	int audio_interleave;
 	int audio_loop_point;
+	audio_preset_t audio_preset;
+	int audio_beam_width; // 1 for greedy encoding
+	int audio_noise_shaping; // 0-3
 
 	bs_codec_t video_codec;
 	int video_width;
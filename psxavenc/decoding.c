@@ -132,6 +132,7 @@ bool open_av_data(decoder_t *decoder, const args_t *args, int flags) {
 	decoder->audio_samples = NULL;
 	decoder->audio_sample_count = 0;
 	decoder->video_frames = NULL;
+	decoder->video_frame_duplicates = NULL;
 	decoder->video_frame_count = 0;
 
 	decoder->video_width = args->video_width;
@@ -449,13 +450,20 @@ static void poll_av_packet_video(decoder_t *decoder, AVPacket *packet) {
 		decoder->video_frames,
 		(decoder->video_frame_count + dupe_frames + 1) * av->video_frame_dst_size
 	);
+	decoder->video_frame_duplicates = realloc(
+		decoder->video_frame_duplicates,
+		(decoder->video_frame_count + dupe_frames + 1) * sizeof(bool)
+	);
 
+	// Duplicates are flagged so that the encoder can reuse the previous frame's
+	// bitstream rather than encoding the same frame again.
 	for (; dupe_frames; dupe_frames--) {
 		memcpy(
 			(decoder->video_frames) + av->video_frame_dst_size * decoder->video_frame_count,
 			(decoder->video_frames) + av->video_frame_dst_size * (decoder->video_frame_count - 1),
 			av->video_frame_dst_size
 		);
+		decoder->video_frame_duplicates[decoder->video_frame_count] = true;
 		decoder->video_frame_count += 1;
 		av->video_next_pts += pts_step;
 	}
@@ -474,24 +482,33 @@ static void poll_av_packet_video(decoder_t *decoder, AVPacket *packet) {
 		dst_strides
 	);
 
+	decoder->video_frame_duplicates[decoder->video_frame_count] = false;
 	decoder->video_frame_count += 1;
 }
 
-bool poll_av_data(decoder_t *decoder) {
+static bool read_av_packet(decoder_t *decoder) {
 	decoder_state_t *av = &(decoder->state);
+	AVPacket packet;
 
-	if (decoder->end_of_input)
+	if (av_read_frame(av->format, &packet) < 0)
 		return false;
 
-	AVPacket packet;
+	if (packet.stream_index == av->audio_stream_index)
+		poll_av_packet_audio(decoder, &packet);
+	else if (packet.stream_index == av->video_stream_index)
+		poll_av_packet_video(decoder, &packet);
 
-	if (av_read_frame(av->format, &packet) >= 0) {
-		if (packet.stream_index == av->audio_stream_index)
-			poll_av_packet_audio(decoder, &packet);
-		else if (packet.stream_index == av->video_stream_index)
-			poll_av_packet_video(decoder, &packet);
+	av_packet_unref(&packet);
+	return true;
+}
 
-		av_packet_unref(&packet);
+bool poll_av_data(decoder_t *decoder) {
+	decoder_state_t *av = &(decoder->state);
+
+	if (decoder->end_of_input)
+		return false;
+
+	if (read_av_packet(decoder)) {
 		return true;
 	} else {
 		// out is always padded out with 4032 "0" samples, this makes calculations elsewhere easier
@@ -533,6 +550,18 @@ bool ensure_av_data(decoder_t *decoder, int needed_audio_samples, int needed_vid
 	return true;
 }
 
+// Reads ahead until more than the given number of video frames are buffered.
+// Unlike ensure_av_data(), this does not set end_of_input once the end of the
+// input file is reached; that is left to the next ensure_av_data() call that
+// actually runs out of data, so encoding loops relying on end_of_input end at
+// the same point regardless of how far ahead frames are buffered.
+void prefetch_av_data(decoder_t *decoder, int needed_video_frames) {
+	while (!decoder->end_of_input && decoder->video_frame_count <= needed_video_frames) {
+		if (!read_av_packet(decoder))
+			break;
+	}
+}
+
 void retire_av_data(decoder_t *decoder, int retired_audio_samples, int retired_video_frames) {
 	//fprintf(stderr, "retire %d -> %d, %d -> %d\n", decoder->audio_sample_count, retired_audio_samples, decoder->video_frame_count, retired_video_frames);
 	assert(retired_audio_samples <= decoder->audio_sample_count);
@@ -547,12 +576,18 @@ void retire_av_data(decoder_t *decoder, int retired_audio_samples, int retired_v
 			decoder->audio_samples + retired_audio_samples,
 			(decoder->audio_sample_count - retired_audio_samples) * sample_size
 		);
-	if (decoder->video_frame_count > retired_video_frames)
+	if (decoder->video_frame_count > retired_video_frames) {
 		memmove(
 			decoder->video_frames,
 			decoder->video_frames + retired_video_frames * frame_size,
 			(decoder->video_frame_count - retired_video_frames) * frame_size
 		);
+		memmove(
+			decoder->video_frame_duplicates,
+			decoder->video_frame_duplicates + retired_video_frames,
+			(decoder->video_frame_count - retired_video_frames) * sizeof(bool)
+		);
+	}
 
 	decoder->audio_sample_count -= retired_audio_samples;
 	decoder->video_frame_count -= retired_video_frames;
@@ -578,4 +613,8 @@ void close_av_data(decoder_t *decoder) {
 		free(decoder->video_frames);
 		decoder->video_frames = NULL;
 	}
+	if(decoder->video_frame_duplicates != NULL) {
+		free(decoder->video_frame_duplicates);
+		decoder->video_frame_duplicates = NULL;
+	}
 }
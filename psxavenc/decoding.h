@@ -56,6 +56,7 @@ typedef struct {
 	int16_t *audio_samples;
 	int audio_sample_count;
 	uint8_t *video_frames;
+	bool *video_frame_duplicates; // Whether each frame is a copy of the previous one
 	int video_frame_count;
 
 	int video_width;
@@ -78,5 +79,6 @@ bool open_av_data(decoder_t *decoder, const args_t *args, int flags);
 int get_av_loop_point(decoder_t *decoder, const args_t *args);
 bool poll_av_data(decoder_t *decoder);
 bool ensure_av_data(decoder_t *decoder, int needed_audio_samples, int needed_video_frames);
+void prefetch_av_data(decoder_t *decoder, int needed_video_frames);
 void retire_av_data(decoder_t *decoder, int retired_audio_samples, int retired_video_frames);
 void close_av_data(decoder_t *decoder);
@@ -24,8 +24,11 @@ freely, subject to the following restrictions:
 
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <libpsxav.h>
@@ -33,6 +36,8 @@ freely, subject to the following restrictions:
 #include "decoding.h"
 #include "mdec.h"
 
+#define SPU_BLOCKS_PER_CHUNK 64
+
 static time_t start_time = 0;
 static time_t last_progress_update = 0;
 
@@ -53,6 +58,28 @@ static time_t get_elapsed_time(void) {
 	return t;
 }
 
+static psx_audio_encoder_settings_t args_to_libpsxav_encoder(const args_t *args) {
+	psx_audio_encoder_settings_t settings;
+
+	switch (args->audio_preset) {
+		case AUDIO_PRESET_FAST:
+			settings.preset = PSX_AUDIO_ENCODER_PRESET_FAST;
+			break;
+
+		case AUDIO_PRESET_EXHAUSTIVE:
+			settings.preset = PSX_AUDIO_ENCODER_PRESET_EXHAUSTIVE;
+			break;
+
+		default:
+			settings.preset = PSX_AUDIO_ENCODER_PRESET_DEFAULT;
+	}
+
+	settings.beam_width = args->audio_beam_width;
+	settings.noise_shaping_order = args->audio_noise_shaping;
+
+	return settings;
+}
+
 static psx_audio_xa_settings_t args_to_libpsxav_xa_audio(const args_t *args) {
 	psx_audio_xa_settings_t settings;
 
@@ -61,6 +88,8 @@ static psx_audio_xa_settings_t args_to_libpsxav_xa_audio(const args_t *args) {
 	settings.stereo = (args->audio_channels == 2);
 	settings.file_number = args->audio_xa_file;
 	settings.channel_number = args->audio_xa_channel;
+	settings.skip_checksums = false;
+	settings.encoder = args_to_libpsxav_encoder(args);
 
 	if (args->format == FORMAT_XACD || args->format == FORMAT_STRCD)
 		settings.format = PSX_AUDIO_XA_FORMAT_XACD;
@@ -161,40 +190,513 @@ static void write_vag_header(const args_t *args, int size_per_channel, uint8_t *
 	strncpy((char*)(header + 0x20), &args->output_file[name_offset], 16);
 }
 
-// The functions below are some peak spaghetti code I would rewrite if that
-// didn't also require scrapping the rest of the codebase. -- spicyjpeg
+// Sectors are finalized (i.e. get their EDC/ECC calculated) by worker threads
+// in batches, so the encoder can move on to the next sector right away. There
+// is one batch being filled plus one for each worker; a batch is only written
+// out and reused once its worker is done, which keeps sectors in order.
+#define SECTOR_BATCH_SIZE 32
+
+typedef struct {
+	uint8_t sectors[SECTOR_BATCH_SIZE][PSX_CDROM_SECTOR_SIZE];
+	psx_cdrom_sector_type_t types[SECTOR_BATCH_SIZE];
+	int count;
+	pthread_t thread;
+	bool thread_started;
+} sector_batch_t;
+
+typedef struct {
+	FILE *output;
+	int sector_size;
+	int batch_count;
+	int current_batch;
+	sector_batch_t *batches;
+} sector_writer_t;
+
+static void *finalize_sector_batch(void *arg) {
+	sector_batch_t *batch = (sector_batch_t *)arg;
+
+	for (int i = 0; i < batch->count; i++)
+		psx_cdrom_calculate_checksums((psx_cdrom_sector_t *)batch->sectors[i], batch->types[i]);
+
+	return NULL;
+}
 
-void encode_file_xa(const args_t *args, decoder_t *decoder, FILE *output) {
-	psx_audio_xa_settings_t xa_settings = args_to_libpsxav_xa_audio(args);
+static void init_sector_writer(const args_t *args, sector_writer_t *writer, FILE *output, int sector_size) {
+	writer->output = output;
+	writer->sector_size = sector_size;
+	writer->batch_count = args->threads + 1;
+	writer->current_batch = 0;
+	writer->batches = malloc(writer->batch_count * sizeof(sector_batch_t));
 
-	int audio_samples_per_sector = psx_audio_xa_get_samples_per_sector(xa_settings);
+	for (int i = 0; i < writer->batch_count; i++) {
+		writer->batches[i].count = 0;
+		writer->batches[i].thread_started = false;
+	}
+}
 
-	psx_audio_encoder_state_t audio_state;
-	memset(&audio_state, 0, sizeof(psx_audio_encoder_state_t));
+static void write_sector_batch(sector_writer_t *writer, sector_batch_t *batch) {
+	if (batch->thread_started)
+		pthread_join(batch->thread, NULL);
 
-	int sector_count = 0;
+	for (int i = 0; i < batch->count; i++)
+		fwrite(batch->sectors[i] + PSX_CDROM_SECTOR_SIZE - writer->sector_size, writer->sector_size, 1, writer->output);
 
-	for (; ensure_av_data(decoder, audio_samples_per_sector * args->audio_channels, 0); sector_count++) {
-		int samples_length = decoder->audio_sample_count / args->audio_channels;
+	batch->count = 0;
+	batch->thread_started = false;
+}
+
+// Returns a zeroed buffer for the next sector. 2336-byte sectors are placed at
+// the end of a 2352-byte buffer, as libpsxav expects.
+static uint8_t *get_next_sector(sector_writer_t *writer) {
+	sector_batch_t *batch = &(writer->batches[writer->current_batch]);
+	uint8_t *sector = batch->sectors[batch->count];
+
+	memset(sector, 0, PSX_CDROM_SECTOR_SIZE);
+	return sector + PSX_CDROM_SECTOR_SIZE - writer->sector_size;
+}
+
+static void commit_sector(sector_writer_t *writer, psx_cdrom_sector_type_t type) {
+	sector_batch_t *batch = &(writer->batches[writer->current_batch]);
+
+	batch->types[batch->count++] = type;
+
+	if (batch->count < SECTOR_BATCH_SIZE)
+		return;
+
+	batch->thread_started = !pthread_create(&(batch->thread), NULL, finalize_sector_batch, batch);
+
+	if (!batch->thread_started)
+		finalize_sector_batch(batch);
+
+	writer->current_batch = (writer->current_batch + 1) % writer->batch_count;
+	write_sector_batch(writer, &(writer->batches[writer->current_batch]));
+}
+
+static void flush_sector_writer(sector_writer_t *writer) {
+	finalize_sector_batch(&(writer->batches[writer->current_batch]));
+
+	for (int i = 1; i <= writer->batch_count; i++)
+		write_sector_batch(writer, &(writer->batches[(writer->current_batch + i) % writer->batch_count]));
+
+	free(writer->batches);
+}
+
+// When verification is enabled, encoded audio is decoded again as soon as it
+// is written out and compared against the input samples it was encoded from,
+// which are queued up until then.
+typedef struct {
+	int channels;
+	psx_audio_decoder_state_t xa_state;
+	psx_audio_decoder_channel_state_t *spu_states;
+
+	int16_t *reference;
+	int reference_offset;
+	int reference_count;
+	int reference_capacity;
+	int16_t *decoded;
+	int decoded_capacity;
+
+	double signal_power;
+	double error_power;
+	int peak_error;
+} audio_verifier_t;
+
+static void init_audio_verifier(const args_t *args, audio_verifier_t *verifier) {
+	memset(verifier, 0, sizeof(audio_verifier_t));
+
+	if (!(args->flags & FLAG_VERIFY_AUDIO))
+		return;
+
+	verifier->channels = args->audio_channels;
+	verifier->spu_states = malloc(args->audio_channels * sizeof(psx_audio_decoder_channel_state_t));
+	memset(verifier->spu_states, 0, args->audio_channels * sizeof(psx_audio_decoder_channel_state_t));
+}
+
+static void free_audio_verifier(audio_verifier_t *verifier) {
+	free(verifier->spu_states);
+	free(verifier->reference);
+	free(verifier->decoded);
+}
+
+static void add_verifier_reference(audio_verifier_t *verifier, const int16_t *samples, int sample_count) {
+	if (!verifier->channels)
+		return;
+
+	int channels = verifier->channels;
+
+	// Only move the queued samples back to the start of the buffer once the
+	// consumed part has grown larger than what is left.
+	if (verifier->reference_offset > verifier->reference_count) {
+		memcpy(
+			verifier->reference,
+			verifier->reference + verifier->reference_offset * channels,
+			verifier->reference_count * channels * sizeof(int16_t)
+		);
+		verifier->reference_offset = 0;
+	}
+
+	int needed = verifier->reference_offset + verifier->reference_count + sample_count;
+
+	if (verifier->reference_capacity < needed) {
+		verifier->reference_capacity = needed * 2;
+		verifier->reference = realloc(verifier->reference, verifier->reference_capacity * channels * sizeof(int16_t));
+	}
+
+	memcpy(
+		verifier->reference + (verifier->reference_offset + verifier->reference_count) * channels,
+		samples,
+		sample_count * channels * sizeof(int16_t)
+	);
+	verifier->reference_count += sample_count;
+}
+
+static int16_t *get_verifier_buffer(audio_verifier_t *verifier, int sample_count) {
+	if (verifier->decoded_capacity < sample_count) {
+		verifier->decoded_capacity = sample_count;
+		verifier->decoded = realloc(verifier->decoded, sample_count * verifier->channels * sizeof(int16_t));
+	}
+
+	return verifier->decoded;
+}
+
+// Compares decoded samples against the oldest queued ones. Any samples past
+// the end of the input (i.e. padding) are ignored.
+static void compare_verifier_samples(audio_verifier_t *verifier, int sample_count) {
+	int channels = verifier->channels;
+
+	if (sample_count > verifier->reference_count)
+		sample_count = verifier->reference_count;
+
+	const int16_t *reference = verifier->reference + verifier->reference_offset * channels;
+	const int16_t *decoded = verifier->decoded;
+	int64_t signal_power = 0;
+	int64_t error_power = 0;
+	int min_error = 0;
+	int max_error = 0;
+
+	for (int i = 0; i < sample_count * channels; i++) {
+		int error = decoded[i] - reference[i];
+
+		signal_power += reference[i] * reference[i];
+		error_power += (int64_t)error * (int64_t)error;
+
+		if (min_error > error) { min_error = error; }
+		if (max_error < error) { max_error = error; }
+	}
+
+	if (verifier->peak_error < -min_error) { verifier->peak_error = -min_error; }
+	if (verifier->peak_error < max_error) { verifier->peak_error = max_error; }
+
+	verifier->signal_power += (double)signal_power;
+	verifier->error_power += (double)error_power;
+	verifier->reference_offset += sample_count;
+	verifier->reference_count -= sample_count;
+}
+
+static void verify_xa_sectors(audio_verifier_t *verifier, psx_audio_xa_settings_t settings, const uint8_t *data, int length) {
+	if (!verifier->channels)
+		return;
+
+	int sector_count = length / psx_audio_xa_get_buffer_size_per_sector(settings);
+	int16_t *buffer = get_verifier_buffer(verifier, sector_count * psx_audio_xa_get_samples_per_sector(settings));
+
+	int sample_count = psx_audio_xa_decode(settings, &(verifier->xa_state), data, length, buffer);
+
+	compare_verifier_samples(verifier, sample_count);
+}
+
+// Decodes length bytes of SPU-ADPCM data for each channel, with channel
+// buffers spaced pitch bytes apart.
+static void verify_spu_blocks(audio_verifier_t *verifier, const uint8_t *data, int length, int pitch) {
+	if (!verifier->channels)
+		return;
+
+	int sample_count = length / PSX_AUDIO_SPU_BLOCK_SIZE * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK;
+	int16_t *buffer = get_verifier_buffer(verifier, sample_count);
+
+	for (int ch = 0; ch < verifier->channels; ch++)
+		psx_audio_spu_decode(&(verifier->spu_states[ch]), data + ch * pitch, length, verifier->channels, buffer + ch);
 
-		if (samples_length > audio_samples_per_sector)
-			samples_length = audio_samples_per_sector;
+	compare_verifier_samples(verifier, sample_count);
+}
+
+static void print_verifier_stats(const args_t *args, const audio_verifier_t *verifier) {
+	if ((args->flags & FLAG_QUIET) || !verifier->channels)
+		return;
+
+	fprintf(
+		stderr,
+		"\nDecoded audio: SNR %.2f dB | Peak error: %d\n",
+		10.0 * log10(verifier->signal_power / verifier->error_power),
+		verifier->peak_error
+	);
+}
 
+// When using multiple threads, audio is read in rounds of up to one segment
+// per thread and all segments in a round are encoded in parallel. The first
+// segment of each round carries on from the exact state the previous round
+// ended with, while the others start from a state obtained by encoding a few
+// samples preceding them. This leaves a small discontinuity ("seam") in the
+// decoded output wherever the two states differ.
+#define XA_SECTORS_PER_SEGMENT 32
+#define SPU_BLOCKS_PER_SEGMENT 4096
+#define SPU_WARMUP_BLOCKS      64
+
+typedef struct {
+	const args_t *args;
+	pthread_t thread;
+	bool thread_started;
+
+	const int16_t *samples; // preceded by warmup_count samples
+	int sample_count;
+	int warmup_count;
+	int lba;
+
+	psx_audio_encoder_state_t state;
+	psx_audio_encoder_state_t initial_state;
+	uint8_t *output;
+	int length;
+} audio_segment_t;
+
+typedef struct {
+	int16_t *samples;
+	int warmup_count;
+	int segment_size;
+	int segment_count;
+	audio_segment_t *segments;
+
+	int seam_count;
+	int seam_max_error;
+	double seam_total_error;
+} audio_rounds_t;
+
+static void *encode_segment_xa(void *arg) {
+	audio_segment_t *segment = (audio_segment_t *)arg;
+	psx_audio_xa_settings_t xa_settings = args_to_libpsxav_xa_audio(segment->args);
+
+	if (segment->warmup_count) {
 		uint8_t sector[PSX_CDROM_SECTOR_SIZE];
-		int length = psx_audio_xa_encode(
+
+		memset(&(segment->state), 0, sizeof(psx_audio_encoder_state_t));
+		psx_audio_xa_encode(
 			xa_settings,
-			&audio_state,
-			decoder->audio_samples,
-			samples_length,
-			sector_count,
+			&(segment->state),
+			segment->samples - segment->warmup_count * segment->args->audio_channels,
+			segment->warmup_count,
+			0,
 			sector
 		);
+	}
 
-		if (decoder->end_of_input)
-			psx_audio_xa_encode_finalize(xa_settings, sector, length);
+	memcpy(&(segment->initial_state), &(segment->state), sizeof(psx_audio_encoder_state_t));
+	memset(segment->output, 0, PSX_CDROM_SECTOR_SIZE * XA_SECTORS_PER_SEGMENT);
+	segment->length = psx_audio_xa_encode(
+		xa_settings,
+		&(segment->state),
+		segment->samples,
+		segment->sample_count,
+		segment->lba,
+		segment->output
+	);
+	return NULL;
+}
 
-		retire_av_data(decoder, samples_length * args->audio_channels, 0);
-		fwrite(sector, length, 1, output);
+static void *encode_segment_spu(void *arg) {
+	audio_segment_t *segment = (audio_segment_t *)arg;
+	psx_audio_encoder_settings_t encoder_settings = args_to_libpsxav_encoder(segment->args);
+
+	if (segment->warmup_count) {
+		uint8_t blocks[SPU_WARMUP_BLOCKS * PSX_AUDIO_SPU_BLOCK_SIZE];
+
+		memset(&(segment->state), 0, sizeof(psx_audio_encoder_state_t));
+		psx_audio_spu_encode(
+			encoder_settings,
+			&(segment->state.left),
+			segment->samples - segment->warmup_count,
+			segment->warmup_count,
+			1,
+			blocks
+		);
+	}
+
+	memcpy(&(segment->initial_state), &(segment->state), sizeof(psx_audio_encoder_state_t));
+	segment->length = psx_audio_spu_encode(
+		encoder_settings,
+		&(segment->state.left),
+		segment->samples,
+		segment->sample_count,
+		1,
+		segment->output
+	);
+	return NULL;
+}
+
+static void init_audio_rounds(
+	const args_t *args,
+	audio_rounds_t *rounds,
+	int segment_size,
+	int warmup_count,
+	int output_size
+) {
+	rounds->warmup_count = warmup_count;
+	rounds->segment_size = segment_size;
+	rounds->segment_count = args->threads;
+	rounds->samples = malloc(segment_size * args->threads * args->audio_channels * sizeof(int16_t));
+	rounds->segments = malloc(args->threads * sizeof(audio_segment_t));
+	memset(rounds->segments, 0, args->threads * sizeof(audio_segment_t));
+
+	for (int i = 0; i < args->threads; i++) {
+		rounds->segments[i].args = args;
+		rounds->segments[i].output = malloc(output_size);
+	}
+
+	rounds->seam_count = 0;
+	rounds->seam_max_error = 0;
+	rounds->seam_total_error = 0.0;
+}
+
+static void free_audio_rounds(audio_rounds_t *rounds) {
+	for (int i = 0; i < rounds->segment_count; i++)
+		free(rounds->segments[i].output);
+
+	free(rounds->samples);
+	free(rounds->segments);
+}
+
+// Reads the next round of samples from the decoder and encodes it, returning
+// the number of segments encoded (0 if there is no data left).
+static int encode_audio_round(
+	const args_t *args,
+	decoder_t *decoder,
+	audio_rounds_t *rounds,
+	void *(*encode_segment)(void *),
+	int lba
+) {
+	int channels = args->audio_channels;
+	int round_size = rounds->segment_size * rounds->segment_count;
+
+	if (!ensure_av_data(decoder, round_size * channels, 0))
+		return 0;
+
+	int samples_length = decoder->audio_sample_count / channels;
+
+	if (samples_length > round_size)
+		samples_length = round_size;
+
+	int16_t *round_samples = rounds->samples;
+	memcpy(round_samples, decoder->audio_samples, samples_length * channels * sizeof(int16_t));
+	retire_av_data(decoder, samples_length * channels, 0);
+
+	int count = 0;
+
+	for (int offset = 0; offset < samples_length; offset += rounds->segment_size, count++) {
+		audio_segment_t *segment = &(rounds->segments[count]);
+
+		segment->samples = round_samples + offset * channels;
+		segment->sample_count = samples_length - offset;
+		// Segments other than the first one warm up on the end of the
+		// previous segment, which is always longer than the warm-up.
+		segment->warmup_count = count ? rounds->warmup_count : 0;
+		segment->lba = lba + count * XA_SECTORS_PER_SEGMENT;
+
+		if (segment->sample_count > rounds->segment_size)
+			segment->sample_count = rounds->segment_size;
+
+		// The first segment continues from where the last one left off.
+		if (count == 0)
+			memcpy(&(segment->state), &(rounds->segments[rounds->segment_count - 1].state), sizeof(psx_audio_encoder_state_t));
+	}
+
+	for (int i = 1; i < count; i++) {
+		audio_segment_t *segment = &(rounds->segments[i]);
+
+		segment->thread_started = !pthread_create(&(segment->thread), NULL, encode_segment, segment);
+
+		if (!segment->thread_started)
+			encode_segment(segment);
+	}
+
+	encode_segment(&(rounds->segments[0]));
+
+	for (int i = 1; i < count; i++) {
+		audio_segment_t *segment = &(rounds->segments[i]);
+
+		if (segment->thread_started)
+			pthread_join(segment->thread, NULL);
+
+		// Measure how far off the approximate starting state was from the
+		// one the previous segment actually ended with.
+		const psx_audio_encoder_channel_state_t *expected = &(rounds->segments[i - 1].state.left);
+		const psx_audio_encoder_channel_state_t *actual = &(segment->initial_state.left);
+
+		for (int ch = 0; ch < channels; ch++, expected++, actual++) {
+			int error = abs(expected->prev1 - actual->prev1);
+			int error2 = abs(expected->prev2 - actual->prev2);
+
+			if (error < error2)
+				error = error2;
+			if (rounds->seam_max_error < error)
+				rounds->seam_max_error = error;
+
+			rounds->seam_total_error += error;
+			rounds->seam_count++;
+		}
+	}
+
+	// Make sure the next round's first segment picks up the right state.
+	if (count < rounds->segment_count)
+		memcpy(&(rounds->segments[rounds->segment_count - 1].state), &(rounds->segments[count - 1].state), sizeof(psx_audio_encoder_state_t));
+
+	return count;
+}
+
+static void print_seam_stats(const args_t *args, const audio_rounds_t *rounds) {
+	if ((args->flags & FLAG_QUIET) || !rounds->seam_count)
+		return;
+
+	fprintf(
+		stderr,
+		"\nSegment seams: %d | Predictor state error: %d max, %.1f average\n",
+		rounds->seam_count,
+		rounds->seam_max_error,
+		rounds->seam_total_error / (double)rounds->seam_count
+	);
+}
+
+static void encode_file_xa_parallel(const args_t *args, decoder_t *decoder, FILE *output) {
+	psx_audio_xa_settings_t xa_settings = args_to_libpsxav_xa_audio(args);
+
+	int audio_samples_per_sector = psx_audio_xa_get_samples_per_sector(xa_settings);
+
+	// XA warm-up must cover entire sectors, as a partial sector would be
+	// padded with silence.
+	audio_rounds_t rounds;
+	init_audio_rounds(
+		args,
+		&rounds,
+		audio_samples_per_sector * XA_SECTORS_PER_SEGMENT,
+		audio_samples_per_sector,
+		PSX_CDROM_SECTOR_SIZE * XA_SECTORS_PER_SEGMENT
+	);
+
+	audio_verifier_t verifier;
+	init_audio_verifier(args, &verifier);
+
+	int sector_count = 0;
+	int count;
+
+	while ((count = encode_audio_round(args, decoder, &rounds, encode_segment_xa, args->base_lba + sector_count))) {
+		for (int i = 0; i < count; i++) {
+			audio_segment_t *segment = &(rounds.segments[i]);
+
+			if (decoder->end_of_input && i == (count - 1))
+				psx_audio_xa_encode_finalize(xa_settings, segment->output, segment->length);
+
+			add_verifier_reference(&verifier, segment->samples, segment->sample_count);
+			verify_xa_sectors(&verifier, xa_settings, segment->output, segment->length);
+			fwrite(segment->output, segment->length, 1, output);
+			sector_count += segment->length / psx_audio_xa_get_buffer_size_per_sector(xa_settings);
+		}
 
 		time_t t = get_elapsed_time();
 
@@ -207,54 +709,178 @@ void encode_file_xa(const args_t *args, decoder_t *decoder, FILE *output) {
 			);
 		}
 	}
+
+	print_seam_stats(args, &rounds);
+	print_verifier_stats(args, &verifier);
+	free_audio_rounds(&rounds);
+	free_audio_verifier(&verifier);
 }
 
-void encode_file_spu(const args_t *args, decoder_t *decoder, FILE *output) {
-	psx_audio_encoder_channel_state_t audio_state;
-	memset(&audio_state, 0, sizeof(psx_audio_encoder_channel_state_t));
+static int encode_spu_data_parallel(
+	const args_t *args,
+	decoder_t *decoder,
+	FILE *output,
+	int block_count,
+	int loop_start_block
+) {
+	audio_rounds_t rounds;
+	init_audio_rounds(
+		args,
+		&rounds,
+		PSX_AUDIO_SPU_SAMPLES_PER_BLOCK * SPU_BLOCKS_PER_SEGMENT,
+		PSX_AUDIO_SPU_SAMPLES_PER_BLOCK * SPU_WARMUP_BLOCKS,
+		PSX_AUDIO_SPU_BLOCK_SIZE * SPU_BLOCKS_PER_SEGMENT
+	);
+
+	audio_verifier_t verifier;
+	init_audio_verifier(args, &verifier);
+
+	int count;
+
+	while ((count = encode_audio_round(args, decoder, &rounds, encode_segment_spu, 0))) {
+		for (int i = 0; i < count; i++) {
+			audio_segment_t *segment = &(rounds.segments[i]);
+			int segment_blocks = segment->length / PSX_AUDIO_SPU_BLOCK_SIZE;
+
+			if (loop_start_block >= block_count && loop_start_block < (block_count + segment_blocks))
+				segment->output[(loop_start_block - block_count) * PSX_AUDIO_SPU_BLOCK_SIZE + 1] |= PSX_AUDIO_SPU_LOOP_START;
+			if ((args->flags & FLAG_SPU_ENABLE_LOOP) && decoder->end_of_input && i == (count - 1))
+				segment->output[segment->length - PSX_AUDIO_SPU_BLOCK_SIZE + 1] |= PSX_AUDIO_SPU_LOOP_REPEAT;
+
+			add_verifier_reference(&verifier, segment->samples, segment->sample_count);
+			verify_spu_blocks(&verifier, segment->output, segment->length, 0);
+			fwrite(segment->output, segment->length, 1, output);
+			block_count += segment_blocks;
+		}
 
-	// The header must be written after the data as we don't yet know the
-	// number of audio samples.
-	if (args->format == FORMAT_VAG)
-		fseek(output, VAG_HEADER_SIZE, SEEK_SET);
+		time_t t = get_elapsed_time();
 
-	uint8_t block[PSX_AUDIO_SPU_BLOCK_SIZE];
-	int block_count = 0;
+		if (!(args->flags & FLAG_HIDE_PROGRESS) && t) {
+			fprintf(
+				stderr,
+				"\rBlock: %6d | Encoding speed: %5.2fx",
+				block_count,
+				(double)(block_count * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK) / (double)(args->audio_frequency * t)
+			);
+		}
+	}
 
-	if (!(args->flags & FLAG_SPU_NO_LEADING_DUMMY)) {
-		// Insert leading silent block
-		memset(block, 0, PSX_AUDIO_SPU_BLOCK_SIZE);
+	print_seam_stats(args, &rounds);
+	print_verifier_stats(args, &verifier);
+	free_audio_rounds(&rounds);
+	free_audio_verifier(&verifier);
+	return block_count;
+}
 
-		fwrite(block, PSX_AUDIO_SPU_BLOCK_SIZE, 1, output);
-		block_count++;
+// The functions below are some peak spaghetti code I would rewrite if that
+// didn't also require scrapping the rest of the codebase. -- spicyjpeg
+
+typedef struct {
+	const args_t *args;
+	psx_audio_xa_settings_t xa_settings;
+	audio_verifier_t verifier;
+	sector_writer_t writer;
+	FILE *output;
+	int loop_start_block;
+	int count; // sectors or blocks written so far
+} audio_stream_context_t;
+
+static void write_xa_sector(uint8_t *data, int length, bool last, void *context) {
+	audio_stream_context_t *ctx = (audio_stream_context_t *)context;
+
+	verify_xa_sectors(&(ctx->verifier), ctx->xa_settings, data, length);
+	memcpy(get_next_sector(&(ctx->writer)), data, length);
+	commit_sector(&(ctx->writer), PSX_CDROM_SECTOR_TYPE_MODE2_FORM2);
+	ctx->count++;
+}
+
+static void write_spu_blocks(uint8_t *data, int length, bool last, void *context) {
+	audio_stream_context_t *ctx = (audio_stream_context_t *)context;
+	int block_count = length / PSX_AUDIO_SPU_BLOCK_SIZE;
+
+	if (ctx->loop_start_block >= ctx->count && ctx->loop_start_block < (ctx->count + block_count))
+		data[(ctx->loop_start_block - ctx->count) * PSX_AUDIO_SPU_BLOCK_SIZE + 1] |= PSX_AUDIO_SPU_LOOP_START;
+	if ((ctx->args->flags & FLAG_SPU_ENABLE_LOOP) && last)
+		data[length - PSX_AUDIO_SPU_BLOCK_SIZE + 1] |= PSX_AUDIO_SPU_LOOP_REPEAT;
+
+	verify_spu_blocks(&(ctx->verifier), data, length, 0);
+	fwrite(data, length, 1, ctx->output);
+	ctx->count += block_count;
+}
+
+void encode_file_xa(const args_t *args, decoder_t *decoder, FILE *output) {
+	if (args->threads > 1) {
+		encode_file_xa_parallel(args, decoder, output);
+		return;
 	}
 
-	int loop_start_block = -1;
+	psx_audio_xa_settings_t xa_settings = args_to_libpsxav_xa_audio(args);
+	xa_settings.skip_checksums = true;
 
-	if (args->audio_loop_point >= 0)
-		loop_start_block = block_count + (args->audio_loop_point * args->audio_frequency) / (PSX_AUDIO_SPU_SAMPLES_PER_BLOCK * 1000);
+	int audio_samples_per_sector = psx_audio_xa_get_samples_per_sector(xa_settings);
 
-	for (; ensure_av_data(decoder, PSX_AUDIO_SPU_SAMPLES_PER_BLOCK, 0); block_count++) {
-		int samples_length = decoder->audio_sample_count;
+	audio_stream_context_t ctx;
+	ctx.args = args;
+	ctx.xa_settings = xa_settings;
+	ctx.output = output;
+	ctx.loop_start_block = -1;
+	ctx.count = 0;
+	init_audio_verifier(args, &(ctx.verifier));
+	init_sector_writer(args, &(ctx.writer), output, psx_audio_xa_get_buffer_size_per_sector(xa_settings));
 
-		if (samples_length > PSX_AUDIO_SPU_SAMPLES_PER_BLOCK)
-			samples_length = PSX_AUDIO_SPU_SAMPLES_PER_BLOCK;
+	psx_audio_xa_stream_t *stream = psx_audio_xa_stream_create(xa_settings, args->base_lba, &write_xa_sector, &ctx);
 
-		int length = psx_audio_spu_encode(
-			&audio_state,
-			decoder->audio_samples,
-			samples_length,
-			1,
-			block
-		);
+	// Whatever the decoder has buffered is handed over to the encoder as a
+	// whole, which keeps any partial sector until more samples are pushed.
+	while (ensure_av_data(decoder, audio_samples_per_sector * args->audio_channels, 0)) {
+		int samples_length = decoder->audio_sample_count / args->audio_channels;
+
+		add_verifier_reference(&(ctx.verifier), decoder->audio_samples, samples_length);
+		psx_audio_xa_stream_push(stream, decoder->audio_samples, samples_length);
+		retire_av_data(decoder, samples_length * args->audio_channels, 0);
+
+		time_t t = get_elapsed_time();
+
+		if (!(args->flags & FLAG_HIDE_PROGRESS) && t) {
+			fprintf(
+				stderr,
+				"\rLBA: %6d | Encoding speed: %5.2fx",
+				ctx.count,
+				(double)(ctx.count * audio_samples_per_sector) / (double)(args->audio_frequency * t)
+			);
+		}
+	}
+
+	psx_audio_xa_stream_flush(stream);
+	psx_audio_xa_stream_destroy(stream);
+	flush_sector_writer(&(ctx.writer));
+	print_verifier_stats(args, &(ctx.verifier));
+	free_audio_verifier(&(ctx.verifier));
+}
 
-		if (block_count == loop_start_block)
-			block[1] |= PSX_AUDIO_SPU_LOOP_START;
-		if ((args->flags & FLAG_SPU_ENABLE_LOOP) && decoder->end_of_input)
-			block[1] |= PSX_AUDIO_SPU_LOOP_REPEAT;
+static int encode_spu_data(
+	const args_t *args,
+	decoder_t *decoder,
+	FILE *output,
+	int block_count,
+	int loop_start_block
+) {
+	audio_stream_context_t ctx;
+	ctx.args = args;
+	ctx.output = output;
+	ctx.loop_start_block = loop_start_block;
+	ctx.count = block_count;
+	init_audio_verifier(args, &(ctx.verifier));
+
+	psx_audio_encoder_settings_t encoder_settings = args_to_libpsxav_encoder(args);
+	psx_audio_spu_stream_t *stream = psx_audio_spu_stream_create(encoder_settings, &write_spu_blocks, &ctx);
+
+	while (ensure_av_data(decoder, SPU_BLOCKS_PER_CHUNK * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK, 0)) {
+		int samples_length = decoder->audio_sample_count;
 
+		add_verifier_reference(&(ctx.verifier), decoder->audio_samples, samples_length);
+		psx_audio_spu_stream_push(stream, decoder->audio_samples, samples_length);
 		retire_av_data(decoder, samples_length, 0);
-		fwrite(block, length, 1, output);
 
 		time_t t = get_elapsed_time();
 
@@ -262,12 +888,46 @@ void encode_file_spu(const args_t *args, decoder_t *decoder, FILE *output) {
 			fprintf(
 				stderr,
 				"\rBlock: %6d | Encoding speed: %5.2fx",
-				block_count,
-				(double)(block_count * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK) / (double)(args->audio_frequency * t)
+				ctx.count,
+				(double)(ctx.count * PSX_AUDIO_SPU_SAMPLES_PER_BLOCK) / (double)(args->audio_frequency * t)
 			);
 		}
 	}
 
+	psx_audio_spu_stream_flush(stream);
+	psx_audio_spu_stream_destroy(stream);
+	print_verifier_stats(args, &(ctx.verifier));
+	free_audio_verifier(&(ctx.verifier));
+	return ctx.count;
+}
+
+void encode_file_spu(const args_t *args, decoder_t *decoder, FILE *output) {
+	// The header must be written after the data as we don't yet know the
+	// number of audio samples.
+	if (args->format == FORMAT_VAG)
+		fseek(output, VAG_HEADER_SIZE, SEEK_SET);
+
+	uint8_t block[PSX_AUDIO_SPU_BLOCK_SIZE];
+	int block_count = 0;
+
+	if (!(args->flags & FLAG_SPU_NO_LEADING_DUMMY)) {
+		// Insert leading silent block
+		memset(block, 0, PSX_AUDIO_SPU_BLOCK_SIZE);
+
+		fwrite(block, PSX_AUDIO_SPU_BLOCK_SIZE, 1, output);
+		block_count++;
+	}
+
+	int loop_start_block = -1;
+
+	if (args->audio_loop_point >= 0)
+		loop_start_block = block_count + (args->audio_loop_point * args->audio_frequency) / (PSX_AUDIO_SPU_SAMPLES_PER_BLOCK * 1000);
+
+	if (args->threads > 1)
+		block_count = encode_spu_data_parallel(args, decoder, output, block_count, loop_start_block);
+	else
+		block_count = encode_spu_data(args, decoder, output, block_count, loop_start_block);
+
 	if (!(args->flags & FLAG_SPU_ENABLE_LOOP)) {
 		// Insert trailing looping block
 		memset(block, 0, PSX_AUDIO_SPU_BLOCK_SIZE);
@@ -313,7 +973,11 @@ void encode_file_spui(const args_t *args, decoder_t *decoder, FILE *output) {
 	psx_audio_encoder_channel_state_t *audio_state = malloc(audio_state_size);
 	memset(audio_state, 0, audio_state_size);
 
+	psx_audio_encoder_settings_t encoder_settings = args_to_libpsxav_encoder(args);
 	uint8_t *chunk = malloc(chunk_size);
+
+	audio_verifier_t verifier;
+	init_audio_verifier(args, &verifier);
 	int chunk_count = 0;
 
 	for (; ensure_av_data(decoder, audio_samples_per_chunk * args->audio_channels, 0); chunk_count++) {
@@ -331,30 +995,35 @@ void encode_file_spui(const args_t *args, decoder_t *decoder, FILE *output) {
 			samples_length -= PSX_AUDIO_SPU_SAMPLES_PER_BLOCK;
 		}
 
-		for (int ch = 0; ch < args->audio_channels; ch++, chunk_ptr += args->audio_interleave) {
-			int length = psx_audio_spu_encode(
-				audio_state + ch,
-				decoder->audio_samples + ch,
-				samples_length,
-				args->audio_channels,
-				chunk_ptr
-			);
+		int length = psx_audio_spu_encode_interleaved(
+			encoder_settings,
+			audio_state,
+			args->audio_channels,
+			decoder->audio_samples,
+			samples_length,
+			chunk_ptr,
+			args->audio_interleave
+		);
 
-			if (length > 0) {
-				uint8_t *last_block = chunk_ptr + length - PSX_AUDIO_SPU_BLOCK_SIZE;
-
-				if (
-					(args->flags & FLAG_SPU_ENABLE_LOOP) ||
-					(decoder->end_of_input && args->audio_loop_point >= 0)
-				) {
-					last_block[1] = PSX_AUDIO_SPU_LOOP_REPEAT;
-				} else if (decoder->end_of_input) {
-					// HACK: the trailing block should in theory be appended to
-					// the existing data, but it's easier to just zerofill and
-					// repurpose the last encoded block.
-					memset(last_block, 0, PSX_AUDIO_SPU_BLOCK_SIZE);
-					last_block[1] = PSX_AUDIO_SPU_LOOP_TRAP;
-				}
+		if (length > 0) {
+			add_verifier_reference(&verifier, decoder->audio_samples, samples_length);
+			verify_spu_blocks(&verifier, chunk_ptr, length, args->audio_interleave);
+		}
+
+		for (int ch = 0; length > 0 && ch < args->audio_channels; ch++, chunk_ptr += args->audio_interleave) {
+			uint8_t *last_block = chunk_ptr + length - PSX_AUDIO_SPU_BLOCK_SIZE;
+
+			if (
+				(args->flags & FLAG_SPU_ENABLE_LOOP) ||
+				(decoder->end_of_input && args->audio_loop_point >= 0)
+			) {
+				last_block[1] = PSX_AUDIO_SPU_LOOP_REPEAT;
+			} else if (decoder->end_of_input) {
+				// HACK: the trailing block should in theory be appended to
+				// the existing data, but it's easier to just zerofill and
+				// repurpose the last encoded block.
+				memset(last_block, 0, PSX_AUDIO_SPU_BLOCK_SIZE);
+				last_block[1] = PSX_AUDIO_SPU_LOOP_TRAP;
 			}
 		}
 
@@ -374,6 +1043,8 @@ void encode_file_spui(const args_t *args, decoder_t *decoder, FILE *output) {
 
 	}
 
+	print_verifier_stats(args, &verifier);
+	free_audio_verifier(&verifier);
 	free(audio_state);
 	free(chunk);
 
@@ -392,6 +1063,8 @@ void encode_file_str(const args_t *args, decoder_t *decoder, FILE *output) {
 	psx_audio_xa_settings_t xa_settings = args_to_libpsxav_xa_audio(args);
 	int sector_size = psx_audio_xa_get_buffer_size_per_sector(xa_settings);
 
+	xa_settings.skip_checksums = true;
+
 	int interleave;
 	int audio_samples_per_sector;
 	int video_sectors_per_block;
@@ -422,7 +1095,9 @@ void encode_file_str(const args_t *args, decoder_t *decoder, FILE *output) {
 	memset(&audio_state, 0, sizeof(psx_audio_encoder_state_t));
 
 	mdec_encoder_t encoder;
-	init_mdec_encoder(&encoder, args->video_codec, args->video_width, args->video_height);
+	init_mdec_encoder(&encoder, args->video_codec, args->video_width, args->video_height, args->threads, 1);
+
+	int macroblock_count = (args->video_width / 16) * (args->video_height / 16);
 
 	// e.g. 15fps = (150*7/8/15) = 8.75 blocks per frame
 	encoder.state.frame_block_base_overflow = (75 * args->str_cd_speed) * video_sectors_per_block * args->str_fps_den;
@@ -438,6 +1113,7 @@ void encode_file_str(const args_t *args, decoder_t *decoder, FILE *output) {
 	encoder.state.frame_max_size = 0;
 	encoder.state.frame_block_overflow_num = 0;
 	encoder.state.quant_scale_sum = 0;
+	encoder.state.reused_macroblocks_sum = 0;
 
 	// FIXME: this needs an extra frame to prevent A/V desync
 	int frames_needed = (int)ceil((double)video_sectors_per_block / frame_size);
@@ -445,12 +1121,16 @@ void encode_file_str(const args_t *args, decoder_t *decoder, FILE *output) {
 	if (frames_needed < 2)
 		frames_needed = 2;
 
+	sector_writer_t writer;
+	init_sector_writer(args, &writer, output, sector_size);
+
 	int sector_count = 0;
 
 	for (; !decoder->end_of_input || encoder.state.frame_data_offset < encoder.state.frame_max_size; sector_count++) {
 		ensure_av_data(decoder, audio_samples_per_sector * args->audio_channels, frames_needed);
+		prefetch_av_data(decoder, frames_needed + args->threads);
 
-		uint8_t sector[PSX_CDROM_SECTOR_SIZE];
+		uint8_t *sector = get_next_sector(&writer);
 		bool is_video_sector;
 
 		if (audio_samples_per_sector == 0)
@@ -461,17 +1141,19 @@ void encode_file_str(const args_t *args, decoder_t *decoder, FILE *output) {
 			is_video_sector = (sector_count % interleave) > 0;
 
 		if (is_video_sector) {
-			init_sector_buffer_video(args, sector, sector_count);
+			init_sector_buffer_video(args, sector, args->base_lba + sector_count);
 
 			int frames_used = encode_sector_str(
 				&encoder,
 				args->format,
 				args->str_video_id,
 				decoder->video_frames,
+				decoder->video_frame_duplicates,
+				decoder->video_frame_count,
 				sector
 			);
 
-			psx_cdrom_calculate_checksums((psx_cdrom_sector_t *)sector, PSX_CDROM_SECTOR_TYPE_MODE2_FORM1);
+			commit_sector(&writer, PSX_CDROM_SECTOR_TYPE_MODE2_FORM1);
 			retire_av_data(decoder, 0, frames_used);
 		} else {
 			int samples_length = decoder->audio_sample_count / args->audio_channels;
@@ -489,32 +1171,33 @@ void encode_file_str(const args_t *args, decoder_t *decoder, FILE *output) {
 				&audio_state,
 				decoder->audio_samples,
 				samples_length,
-				sector_count,
+				args->base_lba + sector_count,
 				sector
 			);
 
 			if (decoder->end_of_input)
 				psx_audio_xa_encode_finalize(xa_settings, sector, length);
 
+			commit_sector(&writer, PSX_CDROM_SECTOR_TYPE_MODE2_FORM2);
 			retire_av_data(decoder, samples_length * args->audio_channels, 0);
 		}
 
-		fwrite(sector, sector_size, 1, output);
-
 		time_t t = get_elapsed_time();
 
 		if (!(args->flags & FLAG_HIDE_PROGRESS) && t) {
 			fprintf(
 				stderr,
-				"\rFrame: %4d | LBA: %6d | Avg. q. scale: %5.2f | Encoding speed: %5.2fx",
+				"\rFrame: %4d | LBA: %6d | Avg. q. scale: %5.2f | MB reuse: %5.1f%% | Encoding speed: %5.2fx",
 				encoder.state.frame_index,
 				sector_count,
 				(double)encoder.state.quant_scale_sum / (double)encoder.state.frame_index,
+				100.0 * (double)encoder.state.reused_macroblocks_sum / ((double)encoder.state.frame_index * macroblock_count),
 				(double)(encoder.state.frame_index * args->str_fps_den) / (double)(t * args->str_fps_num)
 			);
 		}
 	}
 
+	flush_sector_writer(&writer);
 	free(encoder.state.frame_output);
 	destroy_mdec_encoder(&encoder);
 }
@@ -544,7 +1227,9 @@ void encode_file_strspu(const args_t *args, decoder_t *decoder, FILE *output) {
 	}
 
 	mdec_encoder_t encoder;
-	init_mdec_encoder(&encoder, args->video_codec, args->video_width, args->video_height);
+	init_mdec_encoder(&encoder, args->video_codec, args->video_width, args->video_height, args->threads, 1);
+
+	int macroblock_count = (args->video_width / 16) * (args->video_height / 16);
 
 	// e.g. 15fps = (150*7/8/15) = 8.75 blocks per frame
 	encoder.state.frame_block_base_overflow = (75 * args->str_cd_speed) * video_sectors_per_block * args->str_fps_den;
@@ -560,6 +1245,7 @@ void encode_file_strspu(const args_t *args, decoder_t *decoder, FILE *output) {
 	encoder.state.frame_max_size = 0;
 	encoder.state.frame_block_overflow_num = 0;
 	encoder.state.quant_scale_sum = 0;
+	encoder.state.reused_macroblocks_sum = 0;
 
 	// FIXME: this needs an extra frame to prevent A/V desync
 	int frames_needed = (int)ceil((double)video_sectors_per_block / frame_size);
@@ -571,6 +1257,7 @@ void encode_file_strspu(const args_t *args, decoder_t *decoder, FILE *output) {
 
 	for (; !decoder->end_of_input || encoder.state.frame_data_offset < encoder.state.frame_max_size; sector_count++) {
 		ensure_av_data(decoder, audio_samples_per_sector * args->audio_channels, frames_needed);
+		prefetch_av_data(decoder, frames_needed + args->threads);
 
 		uint8_t sector[2048];
 		bool is_video_sector;
@@ -590,6 +1277,8 @@ void encode_file_strspu(const args_t *args, decoder_t *decoder, FILE *output) {
 				args->format,
 				args->str_video_id,
 				decoder->video_frames,
+				decoder->video_frame_duplicates,
+				decoder->video_frame_count,
 				sector
 			);
 
@@ -617,10 +1306,11 @@ void encode_file_strspu(const args_t *args, decoder_t *decoder, FILE *output) {
 		if (!(args->flags & FLAG_HIDE_PROGRESS) && t) {
 			fprintf(
 				stderr,
-				"\rFrame: %4d | LBA: %6d | Avg. q. scale: %5.2f | Encoding speed: %5.2fx",
+				"\rFrame: %4d | LBA: %6d | Avg. q. scale: %5.2f | MB reuse: %5.1f%% | Encoding speed: %5.2fx",
 				encoder.state.frame_index,
 				sector_count,
 				(double)encoder.state.quant_scale_sum / (double)encoder.state.frame_index,
+				100.0 * (double)encoder.state.reused_macroblocks_sum / ((double)encoder.state.frame_index * macroblock_count),
 				(double)(encoder.state.frame_index * args->str_fps_den) / (double)(t * args->str_fps_num)
 			);
 		}
@@ -632,15 +1322,19 @@ void encode_file_strspu(const args_t *args, decoder_t *decoder, FILE *output) {
 
 void encode_file_sbs(const args_t *args, decoder_t *decoder, FILE *output) {
 	mdec_encoder_t encoder;
-	init_mdec_encoder(&encoder, args->video_codec, args->video_width, args->video_height);
+	init_mdec_encoder(&encoder, args->video_codec, args->video_width, args->video_height, 0, args->threads);
+
+	int macroblock_count = (args->video_width / 16) * (args->video_height / 16);
 
 	encoder.state.frame_output = malloc(args->alignment);
 	encoder.state.frame_data_offset = 0;
 	encoder.state.frame_max_size = args->alignment;
 	encoder.state.quant_scale_sum = 0;
+	encoder.state.reused_macroblocks_sum = 0;
 
 	for (int j = 0; ensure_av_data(decoder, 0, 1); j++) {
-		encode_frame_bs(&encoder, decoder->video_frames);
+		if (!decoder->video_frame_duplicates[0] || !reuse_frame_bs(&encoder))
+			encode_frame_bs(&encoder, decoder->video_frames);
 
 		retire_av_data(decoder, 0, 1);
 		fwrite(encoder.state.frame_output, args->alignment, 1, output);
@@ -650,9 +1344,10 @@ void encode_file_sbs(const args_t *args, decoder_t *decoder, FILE *output) {
 		if (!(args->flags & FLAG_HIDE_PROGRESS) && t) {
 			fprintf(
 				stderr,
-				"\rFrame: %4d | Avg. q. scale: %5.2f | Encoding speed: %5.2fx",
+				"\rFrame: %4d | Avg. q. scale: %5.2f | MB reuse: %5.1f%% | Encoding speed: %5.2fx",
 				j,
 				(double)encoder.state.quant_scale_sum / (double)j,
+				100.0 * (double)encoder.state.reused_macroblocks_sum / ((double)j * macroblock_count),
 				(double)(j * args->str_fps_den) / (double)(t * args->str_fps_num)
 			);
 		}
@@ -0,0 +1,528 @@
+/*
+psxavenc: MDEC video + SPU/XA-ADPCM audio encoder frontend
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+Copyright (c) 2023, 2025 spicyjpeg
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <libpsxav.h>
+#include "args.h"
+#include "image.h"
+
+#define SYSTEM_AREA_SECTORS 16
+
+#define PVD_LBA        16
+#define TERMINATOR_LBA 17
+#define L_PATH_LBA     18
+#define M_PATH_LBA     19
+#define ROOT_DIR_LBA   20
+
+#define DIR_RECORD_SIZE 34
+#define XA_RECORD_SIZE  14
+
+enum {
+	XA_ATTR_FORM1       = 1 << 11,
+	XA_ATTR_FORM2       = 1 << 12,
+	XA_ATTR_INTERLEAVED = 1 << 13,
+	XA_ATTR_DIRECTORY   = 1 << 15,
+	XA_ATTR_PERMISSIONS = 0x0555
+};
+
+static void set_le16(uint8_t *data, uint16_t value) {
+	data[0] = (uint8_t)(value);
+	data[1] = (uint8_t)(value >> 8);
+}
+
+static void set_be16(uint8_t *data, uint16_t value) {
+	data[0] = (uint8_t)(value >> 8);
+	data[1] = (uint8_t)(value);
+}
+
+static void set_le32(uint8_t *data, uint32_t value) {
+	data[0] = (uint8_t)(value);
+	data[1] = (uint8_t)(value >> 8);
+	data[2] = (uint8_t)(value >> 16);
+	data[3] = (uint8_t)(value >> 24);
+}
+
+static void set_be32(uint8_t *data, uint32_t value) {
+	data[0] = (uint8_t)(value >> 24);
+	data[1] = (uint8_t)(value >> 16);
+	data[2] = (uint8_t)(value >> 8);
+	data[3] = (uint8_t)(value);
+}
+
+static uint32_t get_le32(const uint8_t *data) {
+	return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+// Most ISO9660 fields are stored twice, first little then big endian.
+static void set_both16(uint8_t *data, uint16_t value) {
+	set_le16(data, value);
+	set_be16(data + 2, value);
+}
+
+static void set_both32(uint8_t *data, uint32_t value) {
+	set_le32(data, value);
+	set_be32(data + 4, value);
+}
+
+static void set_string(uint8_t *data, const char *value, int length) {
+	memset(data, ' ', length);
+	memcpy(data, value, strlen(value));
+}
+
+static void set_volume_date(uint8_t *data, const struct tm *date) {
+	char buffer[17];
+
+	strftime(buffer, sizeof(buffer), "%Y%m%d%H%M%S00", date);
+	memcpy(data, buffer, 16);
+	data[16] = 0; // GMT offset
+}
+
+// Writes a plain ISO9660 directory record, as used for the root directory in
+// the primary volume descriptor.
+static int set_dir_record(
+	uint8_t *data,
+	const char *name,
+	int name_length,
+	int lba,
+	int size,
+	bool directory,
+	const struct tm *date
+) {
+	int length = DIR_RECORD_SIZE + name_length - 1;
+
+	// The name is padded to an even length.
+	length += (length & 1);
+	memset(data, 0, length);
+
+	data[0] = length;
+	set_both32(data + 2, lba);
+	set_both32(data + 10, size);
+	data[18] = date->tm_year;
+	data[19] = date->tm_mon + 1;
+	data[20] = date->tm_mday;
+	data[21] = date->tm_hour;
+	data[22] = date->tm_min;
+	data[23] = date->tm_sec;
+	data[25] = directory ? 0x02 : 0x00;
+	set_both16(data + 28, 1);
+	data[32] = name_length;
+	memcpy(data + 33, name, name_length);
+
+	return length;
+}
+
+// Writes a directory record followed by the XA attributes, as used in
+// directories.
+static int set_xa_dir_record(
+	uint8_t *data,
+	const char *name,
+	int name_length,
+	int lba,
+	int size,
+	uint16_t attributes,
+	int file_number,
+	const struct tm *date
+) {
+	int length = set_dir_record(data, name, name_length, lba, size, (attributes & XA_ATTR_DIRECTORY) != 0, date);
+
+	memset(data + length, 0, XA_RECORD_SIZE);
+	set_be16(data + length + 4, attributes);
+	data[length + 6] = 'X';
+	data[length + 7] = 'A';
+	data[length + 8] = file_number;
+
+	data[0] = length + XA_RECORD_SIZE;
+	return length + XA_RECORD_SIZE;
+}
+
+static void write_form1_sector(FILE *image, int lba, const uint8_t *data, uint8_t submode) {
+	uint8_t sector[PSX_CDROM_SECTOR_SIZE];
+	psx_cdrom_sector_mode2_t *mode2 = (psx_cdrom_sector_mode2_t *)sector;
+
+	memset(sector, 0, PSX_CDROM_SECTOR_SIZE);
+	psx_cdrom_init_sector((psx_cdrom_sector_t *)sector, lba, PSX_CDROM_SECTOR_TYPE_MODE2_FORM1);
+	mode2->subheader[0].submode |= submode;
+	mode2->subheader[1].submode |= submode;
+
+	if (data != NULL)
+		memcpy(mode2->data, data, 2048);
+
+	psx_cdrom_calculate_checksums((psx_cdrom_sector_t *)sector, PSX_CDROM_SECTOR_TYPE_MODE2_FORM1);
+	fseeko(image, (off_t)lba * PSX_CDROM_SECTOR_SIZE, SEEK_SET);
+	fwrite(sector, PSX_CDROM_SECTOR_SIZE, 1, image);
+}
+
+static bool read_sector(FILE *image, int lba, uint8_t *sector) {
+	fseeko(image, (off_t)lba * PSX_CDROM_SECTOR_SIZE, SEEK_SET);
+	return fread(sector, PSX_CDROM_SECTOR_SIZE, 1, image) == 1;
+}
+
+// Writes back a Form 1 sector previously read with read_sector(), keeping its
+// header and subheader but updating its EDC/ECC.
+static void rewrite_form1_sector(FILE *image, int lba, uint8_t *sector) {
+	psx_cdrom_calculate_checksums((psx_cdrom_sector_t *)sector, PSX_CDROM_SECTOR_TYPE_MODE2_FORM1);
+	fseeko(image, (off_t)lba * PSX_CDROM_SECTOR_SIZE, SEEK_SET);
+	fwrite(sector, PSX_CDROM_SECTOR_SIZE, 1, image);
+}
+
+static bool read_volume_descriptor(FILE *image, uint8_t *sector) {
+	const uint8_t *data = ((psx_cdrom_sector_mode2_t *)sector)->data;
+
+	return read_sector(image, PVD_LBA, sector) && (data[0] == 0x01) && !memcmp(data + 1, "CD001", 5);
+}
+
+static int get_file_name(const args_t *args, char *name, int size) {
+	// File names must be upper case and end with a version number.
+	int name_length = snprintf(name, size, strchr(args->image_file_name, ';') ? "%s" : "%s;1", args->image_file_name);
+
+	for (int i = 0; i < name_length; i++)
+		name[i] = toupper(name[i]);
+
+	return name_length;
+}
+
+// By convention the size of files made up of 2336-byte sectors is given in
+// 2048-byte units.
+static int set_file_record(const args_t *args, uint8_t *data, const char *name, int name_length, int file_sectors, const struct tm *date) {
+	uint16_t attributes = XA_ATTR_FORM2 | XA_ATTR_INTERLEAVED | XA_ATTR_PERMISSIONS;
+
+	if (args->format == FORMAT_STRCD)
+		attributes |= XA_ATTR_FORM1;
+
+	return set_xa_dir_record(data, name, name_length, args->base_lba, file_sectors * 2048, attributes, args->audio_xa_file, date);
+}
+
+// Writes a minimal ISO9660 volume whose root directory only contains the
+// encoded file, starting at base_lba and spanning file_sectors sectors. All
+// sectors before base_lba that are not used by the file system are blank.
+static void write_file_system(const args_t *args, FILE *image, int file_sectors) {
+	uint8_t data[2048];
+	char name[40];
+	int name_length = get_file_name(args, name, sizeof(name));
+	int volume_sectors = args->base_lba + file_sectors;
+
+	time_t now = time(NULL);
+	struct tm *date = gmtime(&now);
+
+	for (int lba = 0; lba < args->base_lba; lba++) {
+		if (lba < SYSTEM_AREA_SECTORS || lba > ROOT_DIR_LBA)
+			write_form1_sector(image, lba, NULL, 0);
+	}
+
+	// Primary volume descriptor
+	memset(data, 0, 2048);
+	data[0] = 0x01;
+	memcpy(data + 1, "CD001", 5);
+	data[6] = 0x01;
+	set_string(data + 8, "PLAYSTATION", 32);
+	set_string(data + 40, "PSXAVENC", 32);
+	set_both32(data + 80, volume_sectors);
+	set_both16(data + 120, 1);
+	set_both16(data + 124, 1);
+	set_both16(data + 128, 2048);
+	set_both32(data + 132, 10);
+	set_le32(data + 140, L_PATH_LBA);
+	set_be32(data + 148, M_PATH_LBA);
+	set_dir_record(data + 156, "\0", 1, ROOT_DIR_LBA, 2048, true, date);
+	set_string(data + 190, "", 128);
+	set_string(data + 318, "", 128);
+	set_string(data + 446, "", 128);
+	set_string(data + 574, "PSXAVENC", 128);
+	set_string(data + 702, "", 37);
+	set_string(data + 739, "", 37);
+	set_string(data + 776, "", 37);
+	set_volume_date(data + 813, date);
+	set_volume_date(data + 830, date);
+	memset(data + 847, '0', 16);
+	memset(data + 864, '0', 16);
+	data[881] = 0x01;
+	memcpy(data + 1024, "CD-XA001", 8);
+	write_form1_sector(image, PVD_LBA, data, PSX_CDROM_SECTOR_XA_SUBMODE_EOR);
+
+	// Volume descriptor set terminator
+	memset(data, 0, 2048);
+	data[0] = 0xFF;
+	memcpy(data + 1, "CD001", 5);
+	data[6] = 0x01;
+	write_form1_sector(image, TERMINATOR_LBA, data, PSX_CDROM_SECTOR_XA_SUBMODE_EOR | PSX_CDROM_SECTOR_XA_SUBMODE_EOF);
+
+	// Path tables, each containing the root directory only
+	memset(data, 0, 2048);
+	data[0] = 1;
+	set_le32(data + 2, ROOT_DIR_LBA);
+	set_le16(data + 6, 1);
+	write_form1_sector(image, L_PATH_LBA, data, PSX_CDROM_SECTOR_XA_SUBMODE_EOR | PSX_CDROM_SECTOR_XA_SUBMODE_EOF);
+
+	memset(data, 0, 2048);
+	data[0] = 1;
+	set_be32(data + 2, ROOT_DIR_LBA);
+	set_be16(data + 6, 1);
+	write_form1_sector(image, M_PATH_LBA, data, PSX_CDROM_SECTOR_XA_SUBMODE_EOR | PSX_CDROM_SECTOR_XA_SUBMODE_EOF);
+
+	// Root directory
+	uint16_t dir_attributes = XA_ATTR_FORM1 | XA_ATTR_DIRECTORY | XA_ATTR_PERMISSIONS;
+	int offset = 0;
+
+	memset(data, 0, 2048);
+	offset += set_xa_dir_record(data + offset, "\0", 1, ROOT_DIR_LBA, 2048, dir_attributes, 0, date);
+	offset += set_xa_dir_record(data + offset, "\1", 1, ROOT_DIR_LBA, 2048, dir_attributes, 0, date);
+	offset += set_file_record(args, data + offset, name, name_length, file_sectors, date);
+	write_form1_sector(image, ROOT_DIR_LBA, data, PSX_CDROM_SECTOR_XA_SUBMODE_EOR | PSX_CDROM_SECTOR_XA_SUBMODE_EOF);
+}
+
+// Returns the length of the records in a directory sector, which are followed
+// by zeroes up to the end of the sector.
+static int get_dir_sector_length(const uint8_t *data) {
+	int offset = 0;
+
+	while ((offset < 2048) && data[offset] && ((offset + data[offset]) <= 2048))
+		offset += data[offset];
+
+	return offset;
+}
+
+// Compares a directory record's name with the given one, in the order records
+// are sorted in. The . and .. records (named 0x00 and 0x01) always come first,
+// as file names are upper case.
+static int compare_record_name(const uint8_t *record, const char *name, int name_length) {
+	int record_name_length = record[32];
+	int length = (record_name_length < name_length) ? record_name_length : name_length;
+	int result = memcmp(record + 33, name, length);
+
+	if (result)
+		return result;
+
+	return record_name_length - name_length;
+}
+
+// Adds the encoded file to the root directory of an existing ISO9660 volume,
+// replacing any record with the same name, and grows the volume if the file
+// extends past its end. Records are kept sorted by name. The new record must
+// fit in the directory sector it is sorted into, as records are never moved
+// across sectors.
+static bool update_file_system(const args_t *args, FILE *image, int file_sectors) {
+	uint8_t pvd[PSX_CDROM_SECTOR_SIZE];
+	uint8_t *pvd_data = ((psx_cdrom_sector_mode2_t *)pvd)->data;
+	uint8_t record[256];
+	char name[40];
+	int name_length = get_file_name(args, name, sizeof(name));
+	int volume_sectors = args->base_lba + file_sectors;
+
+	time_t now = time(NULL);
+	struct tm *date = gmtime(&now);
+	int record_length = set_file_record(args, record, name, name_length, file_sectors, date);
+
+	if (!read_volume_descriptor(image, pvd)) {
+		fprintf(stderr, "Failed to read ISO9660 volume descriptor from disc image\n");
+		return false;
+	}
+
+	int dir_lba = get_le32(pvd_data + 156 + 2);
+	int dir_sectors = (get_le32(pvd_data + 156 + 10) + 2047) / 2048;
+	uint8_t *sectors = (dir_sectors > 0) ? malloc(dir_sectors * PSX_CDROM_SECTOR_SIZE) : NULL;
+
+	if (sectors == NULL) {
+		fprintf(stderr, "Invalid root directory in disc image\n");
+		return false;
+	}
+	for (int i = 0; i < dir_sectors; i++) {
+		if (!read_sector(image, dir_lba + i, sectors + i * PSX_CDROM_SECTOR_SIZE)) {
+			fprintf(stderr, "Failed to read root directory from disc image\n");
+			free(sectors);
+			return false;
+		}
+	}
+
+	// Remove the file's old record (if any), then find where to insert the new
+	// one: before the first record that sorts after it, or at the end of the
+	// last non-empty sector.
+	int removed_sector = -1;
+	int insert_sector = -1;
+	int insert_offset = 0;
+
+	for (int i = 0; i < dir_sectors; i++) {
+		uint8_t *data = ((psx_cdrom_sector_mode2_t *)(sectors + i * PSX_CDROM_SECTOR_SIZE))->data;
+		int length = get_dir_sector_length(data);
+		int offset = 0;
+
+		while (offset < length) {
+			int size = data[offset];
+
+			if (!compare_record_name(data + offset, name, name_length)) {
+				memmove(data + offset, data + offset + size, 2048 - offset - size);
+				memset(data + 2048 - size, 0, size);
+				length -= size;
+				removed_sector = i;
+				continue;
+			}
+			if ((insert_sector < 0) && (compare_record_name(data + offset, name, name_length) > 0)) {
+				insert_sector = i;
+				insert_offset = offset;
+			}
+
+			offset += size;
+		}
+	}
+
+	if (insert_sector < 0) {
+		insert_sector = 0;
+
+		for (int i = 0; i < dir_sectors; i++) {
+			if (get_dir_sector_length(((psx_cdrom_sector_mode2_t *)(sectors + i * PSX_CDROM_SECTOR_SIZE))->data))
+				insert_sector = i;
+		}
+
+		insert_offset = get_dir_sector_length(((psx_cdrom_sector_mode2_t *)(sectors + insert_sector * PSX_CDROM_SECTOR_SIZE))->data);
+	}
+
+	uint8_t *data = ((psx_cdrom_sector_mode2_t *)(sectors + insert_sector * PSX_CDROM_SECTOR_SIZE))->data;
+	int length = get_dir_sector_length(data);
+
+	if ((length + record_length) > 2048) {
+		fprintf(stderr, "Not enough space in disc image's root directory to add %s\n", name);
+		free(sectors);
+		return false;
+	}
+
+	memmove(data + insert_offset + record_length, data + insert_offset, length - insert_offset);
+	memcpy(data + insert_offset, record, record_length);
+	rewrite_form1_sector(image, dir_lba + insert_sector, sectors + insert_sector * PSX_CDROM_SECTOR_SIZE);
+
+	if ((removed_sector >= 0) && (removed_sector != insert_sector))
+		rewrite_form1_sector(image, dir_lba + removed_sector, sectors + removed_sector * PSX_CDROM_SECTOR_SIZE);
+
+	free(sectors);
+
+	if ((int)get_le32(pvd_data + 80) < volume_sectors) {
+		set_both32(pvd_data + 80, volume_sectors);
+		rewrite_form1_sector(image, PVD_LBA, pvd);
+	}
+
+	return true;
+}
+
+// Writes a cue sheet next to the image. An existing cue sheet is only replaced
+// if replace is set.
+static bool write_cue_sheet(const args_t *args, bool replace) {
+	int path_length = strlen(args->output_file);
+	char *cue_path = malloc(path_length + 5);
+	const char *extension = strrchr(args->output_file, '.');
+	const char *name = args->output_file;
+
+	for (const char *ptr = args->output_file; *ptr; ptr++) {
+		if (*ptr == '/' || *ptr == '\\')
+			name = ptr + 1;
+	}
+	if (extension == NULL || extension < name)
+		extension = args->output_file + path_length;
+
+	memcpy(cue_path, args->output_file, extension - args->output_file);
+	strcpy(cue_path + (extension - args->output_file), ".cue");
+
+	FILE *cue = replace ? NULL : fopen(cue_path, "r");
+
+	if (cue != NULL) {
+		fclose(cue);
+		free(cue_path);
+		return true;
+	}
+
+	cue = fopen(cue_path, "w");
+
+	if (cue == NULL) {
+		fprintf(stderr, "Failed to open cue sheet: %s\n", cue_path);
+		free(cue_path);
+		return false;
+	}
+
+	fprintf(
+		cue,
+		"FILE \"%s\" BINARY\n"
+		"  TRACK 01 MODE2/2352\n"
+		"    INDEX 01 00:00:00\n",
+		name
+	);
+
+	fclose(cue);
+	free(cue_path);
+	return true;
+}
+
+// Existing images are updated in place, only overwriting the sectors taken
+// up by the encoded file, and must already contain an ISO9660 volume. Once the
+// file's length is known, new images get a file system and a cue sheet, while
+// the file is added to the root directory of existing ones.
+FILE *open_output_image(const args_t *args, bool *created) {
+	FILE *image = fopen(args->output_file, "r+b");
+
+	*created = (image == NULL);
+
+	if (*created) {
+		if (args->base_lba < IMAGE_MIN_BASE_LBA) {
+			fprintf(stderr, "Invalid base LBA for new disc image: %d (must be %d or greater)\n", args->base_lba, IMAGE_MIN_BASE_LBA);
+			return NULL;
+		}
+
+		image = fopen(args->output_file, "w+b");
+	} else {
+		uint8_t pvd[PSX_CDROM_SECTOR_SIZE];
+
+		if (!read_volume_descriptor(image, pvd)) {
+			fprintf(stderr, "Existing disc image has no ISO9660 volume descriptor: %s\n", args->output_file);
+			fclose(image);
+			return NULL;
+		}
+
+		// Fill any gap between the end of the image and the file with blank
+		// sectors.
+		fseeko(image, 0, SEEK_END);
+
+		for (int lba = (int)(ftello(image) / PSX_CDROM_SECTOR_SIZE); lba < args->base_lba; lba++)
+			write_form1_sector(image, lba, NULL, 0);
+	}
+	if (image != NULL)
+		fseeko(image, (off_t)args->base_lba * PSX_CDROM_SECTOR_SIZE, SEEK_SET);
+
+	return image;
+}
+
+bool finish_output_image(const args_t *args, FILE *image, bool created) {
+	int file_sectors = (int)(ftello(image) / PSX_CDROM_SECTOR_SIZE) - args->base_lba;
+
+	if (created) {
+		write_file_system(args, image, file_sectors);
+	} else {
+		if (!update_file_system(args, image, file_sectors))
+			return false;
+	}
+
+	return write_cue_sheet(args, created);
+}
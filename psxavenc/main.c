@@ -22,11 +22,13 @@ freely, subject to the following restrictions:
 3. This notice may not be removed or altered from any source distribution.
 */
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include "args.h"
 #include "decoding.h"
 #include "filefmt.h"
+#include "image.h"
 
 static const char *const bs_codec_names[NUM_BS_CODECS] = {
 	"BS v2",
@@ -60,6 +62,9 @@ int main(int argc, const char **argv) {
 	args.output_file = NULL;
 	args.swresample_options = NULL;
 	args.swscale_options = NULL;
+	args.threads = 1;
+	args.base_lba = 0;
+	args.image_file_name = NULL;
 
 	if (!parse_args(&args, argv + 1, argc - 1))
 		return 1;
@@ -68,7 +73,12 @@ int main(int argc, const char **argv) {
 		return 1;
 	}
 
-	output = fopen(args.output_file, "wb");
+	bool image_created = false;
+
+	if (args.image_file_name != NULL)
+		output = open_output_image(&args, &image_created);
+	else
+		output = fopen(args.output_file, "wb");
 
 	if (output == NULL) {
 		fprintf(stderr, "Failed to open output file: %s\n", args.output_file);
@@ -203,6 +213,12 @@ int main(int argc, const char **argv) {
 			;
 	}
 
+	if (args.image_file_name != NULL && !finish_output_image(&args, output, image_created)) {
+		fclose(output);
+		close_av_data(&decoder);
+		return 1;
+	}
+
 	if (!(args.flags & FLAG_HIDE_PROGRESS))
 		fprintf(stderr, "\nDone.\n");
 
@@ -24,6 +24,7 @@ freely, subject to the following restrictions:
 
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -32,6 +33,11 @@ freely, subject to the following restrictions:
 #include "args.h"
 #include "mdec.h"
 
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define MDEC_USE_X86_SIMD
+#include <immintrin.h>
+#endif
+
 #define AC_PAIR(zeroes, value) \
 	(((zeroes) << 10) | ((+(value)) & 0x3FF)), \
 	(((zeroes) << 10) | ((-(value)) & 0x3FF))
@@ -253,6 +259,10 @@ enum {
 
 #define HUFFMAN_CODE(bits, value) (((bits) << 24) | (value))
 
+// Marks entries in flat_dc_coeffs for sample values whose flat blocks still
+// have to go through the DCT.
+#define FLAT_BLOCK_INELIGIBLE INT16_MIN
+
 static void init_dct_data(mdec_encoder_state_t *state, bs_codec_t codec) {
 	for(int i = 0; i <= 0xFFFF; i++) {
 		state->ac_huffman_map[i] = HUFFMAN_CODE(6 + 16, (0x1 << 16) | i);
@@ -318,70 +328,49 @@ static void init_dct_data(mdec_encoder_state_t *state, bs_codec_t codec) {
 	}
 }
 
-static bool flush_bits(mdec_encoder_state_t *state) {
-	if(state->bits_left < 16) {
-		state->frame_output[state->bytes_used++] = (uint8_t)state->bits_value;
-		if (state->bytes_used >= state->frame_max_size)
-			return false;
-
-		state->frame_output[state->bytes_used++] = (uint8_t)(state->bits_value>>8);
+// The bitstream is made up of 16-bit little endian words, each filled starting
+// from the most significant bit. Codes are shifted into a 64-bit accumulator
+// and written out 32 bits (two words) at a time; as no code is longer than 24
+// bits, at most 31 + 24 bits are ever pending. Bounds checking is left to the
+// caller, which must make sure all codes fit before writing any of them.
+static inline void encode_bits(mdec_encoder_state_t *state, int bits, uint32_t val) {
+	assert(bits <= 24);
+	assert(val < (1 << bits));
+
+	state->bits_value = (state->bits_value << bits) | val;
+	state->bits_pending += bits;
+
+	if (state->bits_pending >= 32) {
+		state->bits_pending -= 32;
+
+		uint32_t words = (uint32_t)(state->bits_value >> state->bits_pending);
+		uint8_t *output = state->frame_output + state->bytes_used;
+
+		output[0] = (uint8_t)(words >> 16);
+		output[1] = (uint8_t)(words >> 24);
+		output[2] = (uint8_t)words;
+		output[3] = (uint8_t)(words >> 8);
+		state->bytes_used += 4;
 	}
-
-	state->bits_left = 16;
-	state->bits_value = 0;
-	return true;
 }
 
-static bool encode_bits(mdec_encoder_state_t *state, int bits, uint32_t val) {
-	assert(val < (1<<bits));
+// Writes out any pending bits, padding the last word with zeroes.
+static void flush_bits(mdec_encoder_state_t *state) {
+	while (state->bits_pending > 0) {
+		uint16_t word;
 
-	// FIXME: for some reason the main logic breaks when bits > 16
-	// and I have no idea why, so I have to split this up --GM
-	if (bits > 16) {
-		if (!encode_bits(state, bits-16, val>>16))
-			return false;
+		if (state->bits_pending >= 16)
+			word = (uint16_t)(state->bits_value >> (state->bits_pending - 16));
+		else
+			word = (uint16_t)(state->bits_value << (16 - state->bits_pending));
 
-		bits = 16;
-		val &= 0xFFFF;
+		state->frame_output[state->bytes_used++] = (uint8_t)word;
+		state->frame_output[state->bytes_used++] = (uint8_t)(word >> 8);
+		state->bits_pending -= 16;
 	}
 
-	if (state->bits_left == 0) {
-		if (!flush_bits(state))
-			return false;
-	}
-
-	while (bits > state->bits_left) {
-		// Bits need truncating
-		uint32_t outval = val;
-		outval >>= bits - state->bits_left;
-		assert(outval < (1<<16));
-		//uint16_t old_value = state->bits_value;
-		assert((state->bits_value & outval) == 0);
-		state->bits_value |= (uint16_t)outval;
-		//fprintf(stderr, "trunc %2d %2d %08X %04X %04X\n", bits, state->bits_left, val, old_value, state->bits_value);
-		bits -= state->bits_left;
-		uint32_t mask = (1<<bits)-1;
-		val &= mask;
-		assert(mask >= 1);
-		assert(val < (1<<bits));
-		if (!flush_bits(state))
-			return false;
-	}
-
-	if (bits >= 1) {
-		assert(bits <= 16);
-		// Bits may need shifting into place
-		uint32_t outval = val;
-		outval <<= state->bits_left - bits;
-		assert(outval < (1<<16));
-		//uint16_t old_value = state->bits_value;
-		assert((state->bits_value & outval) == 0);
-		state->bits_value |= (uint16_t)outval;
-		//fprintf(stderr, "plop  %2d %2d %08X %04X %04X\n", bits, state->bits_left, val, state->bits_value);
-		state->bits_left -= bits;
-	}
-
-	return true;
+	state->bits_pending = 0;
+	state->bits_value = 0;
 }
 
 #if 0
@@ -438,81 +427,745 @@ static int reduce_dct_block(mdec_encoder_state_t *state, int32_t *block, int32_t
 #define DIVIDE_ROUNDED(n, d) ((int)round((double)(n) / (double)(d)))
 #endif
 
-static bool encode_dct_block(
-	mdec_encoder_state_t *state,
-	bs_codec_t codec,
-	const int16_t *block,
-	const int16_t *quant_table
-) {
-	int dc = DIVIDE_ROUNDED(block[0], quant_table[0]);
+// AC coefficients are instead quantized by multiplying them with reciprocals,
+// giving the same results as DIVIDE_ROUNDED() (i.e. rounding halves away from
+// zero) without a division: round(n / d) = floor((2 * abs(n) + d) / (2 * d)),
+// with the sign of n applied afterwards. Multiplying by ceil(2^32 / (2 * d))
+// and dropping the low 32 bits of the product yields the exact quotient as
+// long as (2 * abs(n) + d) * 2 * d < 2^32, which always holds for 16-bit
+// coefficients and the largest possible divisor (83 * 63).
+#define QUANT_RECIPROCAL(d) ((uint32_t)(((1ULL << 32) + 2 * (d) - 1) / (2 * (d))))
+
+static void quantize_block(const int16_t *block, const uint32_t *quant_table, const uint32_t *quant_recips, int16_t *output) {
+	for (int i = 0; i < 64; i++) {
+		int n = block[i];
+		uint32_t x = 2 * (uint32_t)abs(n) + quant_table[i];
+		int q = (int)(((uint64_t)x * quant_recips[i]) >> 32);
+
+		if (n < 0)
+			q = -q;
+		if (q < -0x200)
+			q = -0x200;
+		else if (q > +0x1FE)
+			q = +0x1FE; // 0x1FF = v2 end of frame
+
+		output[i] = (int16_t)q;
+	}
+}
+
+#ifdef MDEC_USE_X86_SIMD
+// Same as quantize_block(), but processes 16 coefficients at a time using
+// 32x32->64-bit multiplies on the even and odd 32-bit lanes.
+__attribute__((target("avx2")))
+static void quantize_block_avx2(const int16_t *block, const uint32_t *quant_table, const uint32_t *quant_recips, int16_t *output) {
+	const __m256i min_value = _mm256_set1_epi32(-0x200);
+	const __m256i max_value = _mm256_set1_epi32(+0x1FE);
+
+	for (int i = 0; i < 64; i += 16) {
+		__m256i q[2];
+
+		for (int j = 0; j < 2; j++) {
+			__m256i n = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(block + i + j*8)));
+			__m256i d = _mm256_loadu_si256((const __m256i *)(quant_table + i + j*8));
+			__m256i r = _mm256_loadu_si256((const __m256i *)(quant_recips + i + j*8));
+
+			__m256i x = _mm256_add_epi32(_mm256_slli_epi32(_mm256_abs_epi32(n), 1), d);
+			__m256i even = _mm256_srli_epi64(_mm256_mul_epu32(x, r), 32);
+			__m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), _mm256_srli_epi64(r, 32));
+
+			q[j] = _mm256_blend_epi32(even, odd, 0xAA);
+			q[j] = _mm256_sign_epi32(q[j], n);
+			q[j] = _mm256_min_epi32(_mm256_max_epi32(q[j], min_value), max_value);
+		}
 
-	dc = state->coeff_clamp_map[dc & 0xFFFF];
+		// packs_epi32() interleaves 64-bit chunks of its inputs, so they have
+		// to be put back in order.
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(q[0], q[1]), 0xD8);
+		_mm256_storeu_si256((__m256i *)(output + i), packed);
+	}
+}
+#endif
+
+// Returns a mask with bit i set for each nonzero coefficient in the block, so
+// that runs of zeroes can be skipped over rather than scanned one by one.
+static uint64_t get_nonzero_mask(const int16_t *coeffs) {
+	uint64_t mask = 0;
+
+	for (int i = 0; i < 64; i++)
+		mask |= (uint64_t)(coeffs[i] != 0) << i;
+
+	return mask;
+}
+
+#ifdef MDEC_USE_X86_SIMD
+__attribute__((target("sse2")))
+static uint64_t get_nonzero_mask_sse2(const int16_t *coeffs) {
+	const __m128i zero = _mm_setzero_si128();
+	uint64_t mask = 0;
+
+	for (int i = 0; i < 64; i += 16) {
+		__m128i a = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(coeffs + i)), zero);
+		__m128i b = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(coeffs + i + 8)), zero);
+		uint64_t zeroes = (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(a, b));
+
+		mask |= (zeroes ^ 0xFFFF) << i;
+	}
+
+	return mask;
+}
+#endif
+
+static inline int count_trailing_zeroes(uint64_t value) {
+#ifdef __GNUC__
+	return __builtin_ctzll(value);
+#else
+	int count = 0;
+
+	for (; !(value & 1); value >>= 1)
+		count++;
+
+	return count;
+#endif
+}
+
+// The DC coefficients are always quantized with the same scale, so their codes
+// can be generated once per frame rather than at each quantization scale tried.
+// This also keeps the DC prediction chain, which spans the entire frame, out of
+// the per-stripe code.
+static void encode_dc_coeffs(mdec_encoder_t *encoder) {
+	mdec_encoder_state_t *state = &(encoder->state);
+
+	int dct_block_count_x = (encoder->video_width + 15) / 16;
+	int dct_block_count_y = (encoder->video_height + 15) / 16;
+	int dc_quant = quant_dec[0] * 8;
+
+	state->block_type = 0;
+	state->last_dc_values[INDEX_CR] = 0;
+	state->last_dc_values[INDEX_CB] = 0;
+	state->last_dc_values[INDEX_Y] = 0;
+
+	for (int fx = 0; fx < dct_block_count_x; fx++) {
+		for (int fy = 0; fy < dct_block_count_y; fy++) {
+			int block_index = fy*dct_block_count_x + fx;
 
-	if (codec == BS_CODEC_V2) {
-		if (!encode_bits(state, 10, dc & 0x3FF))
+			for (int i = 0; i < 6; i++) {
+				int dc = DIVIDE_ROUNDED(state->dct_block_lists[i][64 * block_index], dc_quant);
+
+				dc = state->coeff_clamp_map[dc & 0xFFFF];
+
+				if (encoder->video_codec == BS_CODEC_V2) {
+					state->dc_codes[6 * block_index + i] = HUFFMAN_CODE(10, dc & 0x3FF);
+					continue;
+				}
+
+				int index = state->block_type;
+
+				if (index > INDEX_Y)
+					index = INDEX_Y;
+
+				int delta = DIVIDE_ROUNDED(dc - state->last_dc_values[index], 4);
+				state->last_dc_values[index] += delta * 4;
+
+				// Some versions of Sony's BS v3 decoder compute each DC
+				// coefficient as ((last + delta * 4) & 0x3FF) instead of just
+				// (last + delta * 4). The encoder can leverage this behavior to
+				// represent large coefficient differences as smaller deltas
+				// that cause the decoder to overflow and wrap around (e.g. -1
+				// to encode -512 -> 511 as opposed to +1023). This saves some
+				// space as larger DC values take up more bits.
+				if (encoder->video_codec == BS_CODEC_V3DC) {
+					if (delta < -0x80)
+						delta += 0x100;
+					else if (delta > +0x80)
+						delta -= 0x100;
+				}
+
+				state->dc_codes[6 * block_index + i] = state->dc_huffman_map[(index << 9) | (delta & 0x1FF)];
+
+				state->block_type++;
+				state->block_type %= 6;
+			}
+		}
+	}
+}
+
+enum {
+	STRIPE_TASK_TRANSFORM,
+	STRIPE_TASK_COUNT_BITS,
+	STRIPE_TASK_ENCODE
+};
+
+// Copies a 16x16 macroblock's luma and the matching 8x8 interleaved Cr/Cb
+// samples into six blocks, converting them to signed values.
+// Order: Cr Cb [Y1|Y2]
+//              [Y3|Y4]
+static void gather_macroblock(int16_t *const *blocks, const uint8_t *y_data, const uint8_t *c_data, int pitch) {
+	for (int y = 0; y < 8; y++) {
+		for (int x = 0; x < 8; x++) {
+			int k = y*8 + x;
+
+			blocks[0][k] = (int16_t)c_data[pitch*y + 2*x + 0] - 128;
+			blocks[1][k] = (int16_t)c_data[pitch*y + 2*x + 1] - 128;
+			blocks[2][k] = (int16_t)y_data[pitch*(y+0) + (x+0)] - 128;
+			blocks[3][k] = (int16_t)y_data[pitch*(y+0) + (x+8)] - 128;
+			blocks[4][k] = (int16_t)y_data[pitch*(y+8) + (x+0)] - 128;
+			blocks[5][k] = (int16_t)y_data[pitch*(y+8) + (x+8)] - 128;
+		}
+	}
+}
+
+#ifdef MDEC_USE_X86_SIMD
+// Same as gather_macroblock(), but handles one 16-byte row of each plane at a
+// time. Interleaved chroma is split by masking and shifting 16-bit lanes,
+// which also zero-extends each sample.
+__attribute__((target("sse2")))
+static void gather_macroblock_sse2(int16_t *const *blocks, const uint8_t *y_data, const uint8_t *c_data, int pitch) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i low_mask = _mm_set1_epi16(0x00FF);
+	const __m128i bias = _mm_set1_epi16(128);
+
+	for (int y = 0; y < 8; y++) {
+		__m128i c = _mm_loadu_si128((const __m128i *)(c_data + pitch*y));
+		__m128i y_top = _mm_loadu_si128((const __m128i *)(y_data + pitch*y));
+		__m128i y_bottom = _mm_loadu_si128((const __m128i *)(y_data + pitch*(y+8)));
+
+		__m128i cr = _mm_and_si128(c, low_mask);
+		__m128i cb = _mm_srli_epi16(c, 8);
+
+		_mm_storeu_si128((__m128i *)(blocks[0] + y*8), _mm_sub_epi16(cr, bias));
+		_mm_storeu_si128((__m128i *)(blocks[1] + y*8), _mm_sub_epi16(cb, bias));
+		_mm_storeu_si128((__m128i *)(blocks[2] + y*8), _mm_sub_epi16(_mm_unpacklo_epi8(y_top, zero), bias));
+		_mm_storeu_si128((__m128i *)(blocks[3] + y*8), _mm_sub_epi16(_mm_unpackhi_epi8(y_top, zero), bias));
+		_mm_storeu_si128((__m128i *)(blocks[4] + y*8), _mm_sub_epi16(_mm_unpacklo_epi8(y_bottom, zero), bias));
+		_mm_storeu_si128((__m128i *)(blocks[5] + y*8), _mm_sub_epi16(_mm_unpackhi_epi8(y_bottom, zero), bias));
+	}
+}
+#endif
+
+// Returns true if all samples in the block have the same value.
+static bool is_flat_block(const int16_t *block) {
+	for (int i = 1; i < 64; i++) {
+		if (block[i] != block[0])
 			return false;
-	} else {
-		int index = state->block_type;
-
-		if (index > INDEX_Y)
-			index = INDEX_Y;
-
-		int delta = DIVIDE_ROUNDED(dc - state->last_dc_values[index], 4);
-		state->last_dc_values[index] += delta * 4;
-
-		// Some versions of Sony's BS v3 decoder compute each DC coefficient as
-		// ((last + delta * 4) & 0x3FF) instead of just (last + delta * 4). The
-		// encoder can leverage this behavior to represent large coefficient
-		// differences as smaller deltas that cause the decoder to overflow and
-		// wrap around (e.g. -1 to encode -512 -> 511 as opposed to +1023). This
-		// saves some space as larger DC values take up more bits.
-		if (codec == BS_CODEC_V3DC) {
-			if (delta < -0x80)
-				delta += 0x100;
-			else if (delta > +0x80)
-				delta -= 0x100;
+	}
+
+	return true;
+}
+
+// Runs the DCT once on a flat block of each possible sample value, so that
+// flat blocks (common in letterboxing and fades) can skip it later on. Values
+// for which the DCT does not produce a DC coefficient alone are marked as not
+// eligible.
+static void init_flat_dc_coeffs(mdec_encoder_state_t *state) {
+	for (int i = 0; i < 256; i++) {
+		int16_t block[8*8];
+
+		for (int j = 0; j < 64; j++)
+			block[j] = (int16_t)i - 128;
+
+		state->dct_context->fdct(block);
+		state->flat_dc_coeffs[i] = block[0];
+
+		for (int j = 1; j < 64; j++) {
+			if (block[j] != 0) {
+				state->flat_dc_coeffs[i] = FLAT_BLOCK_INELIGIBLE;
+				break;
+			}
+		}
+	}
+}
+
+// Size of the luma and interleaved chroma samples of a macroblock.
+#define MACROBLOCK_SAMPLES_SIZE (16*16 + 16*8)
+
+// Hashes the luma and interleaved chroma samples of a macroblock, 8 bytes at a
+// time. The hash is only used to quickly rule out changed macroblocks; matches
+// are confirmed by comparing the samples with match_macroblock().
+static uint64_t hash_macroblock(const uint8_t *y_data, const uint8_t *c_data, int pitch) {
+	uint64_t hash = 0;
+
+	for (int y = 0; y < 24; y++) {
+		const uint8_t *row = (y < 16) ? (y_data + pitch*y) : (c_data + pitch*(y-16));
+
+		for (int x = 0; x < 16; x += 8) {
+			uint64_t word;
+			memcpy(&word, row + x, 8);
+
+			hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+			hash ^= hash >> 32;
 		}
+	}
 
-		uint32_t outword = state->dc_huffman_map[(index << 9) | (delta & 0x1FF)];
+	return hash;
+}
+
+// Compares the samples of a macroblock with the copy stored by
+// store_macroblock().
+static bool match_macroblock(const uint8_t *samples, const uint8_t *y_data, const uint8_t *c_data, int pitch) {
+	for (int y = 0; y < 24; y++) {
+		const uint8_t *row = (y < 16) ? (y_data + pitch*y) : (c_data + pitch*(y-16));
 
-		if (!encode_bits(state, outword >> 24, outword & 0xFFFFFF))
+		if (memcmp(samples + 16*y, row, 16))
 			return false;
 	}
 
-	for (int i = 1, zeroes = 0; i < 64; i++) {
-		int ri = dct_zagzig_table[i];
-		int ac = DIVIDE_ROUNDED(block[ri], quant_table[ri]);
+	return true;
+}
 
-		ac = state->coeff_clamp_map[ac & 0xFFFF];
+static void store_macroblock(uint8_t *samples, const uint8_t *y_data, const uint8_t *c_data, int pitch) {
+	for (int y = 0; y < 24; y++) {
+		const uint8_t *row = (y < 16) ? (y_data + pitch*y) : (c_data + pitch*(y-16));
 
-		if (ac == 0) {
-			zeroes++;
-		} else {
-			uint32_t outword = state->ac_huffman_map[(zeroes << 10) | (ac & 0x3FF)];
+		memcpy(samples + 16*y, row, 16);
+	}
+}
 
-			if (!encode_bits(state, outword >> 24, outword & 0xFFFFFF))
-				return false;
+// Rearranges the Y/C planes returned by libswscale into macroblocks and
+// applies the DCT to them. Macroblocks identical to the ones in the last frame
+// passed to this encoder are skipped, as their coefficients are still in the
+// buffers.
+static void transform_stripe(mdec_stripe_t *stripe) {
+	mdec_encoder_t *encoder = stripe->encoder;
+	mdec_encoder_state_t *state = &(encoder->state);
 
-			zeroes = 0;
-			state->uncomp_hwords_used++;
+	int pitch = encoder->video_width;
+#if 0
+	int real_index = state->frame_index - 1;
+	if (real_index > (video_frame_count - 1))
+		real_index = video_frame_count - 1;
+
+	const uint8_t *y_plane = video_frames + encoder->video_width * encoder->video_height * 3/2 * real_index;
+#else
+	const uint8_t *y_plane = stripe->video_frame;
+	const uint8_t *c_plane = y_plane + (encoder->video_width * encoder->video_height);
+#endif
+
+	int dct_block_count_x = (encoder->video_width + 15) / 16;
+	int dct_block_count_y = (encoder->video_height + 15) / 16;
+
+#ifdef MDEC_USE_X86_SIMD
+	bool use_sse2 = __builtin_cpu_supports("sse2");
+#endif
+
+	stripe->reused_macroblocks = 0;
+
+	for (int fx = stripe->first_column; fx < (stripe->first_column + stripe->column_count); fx++) {
+		for (int fy = 0; fy < dct_block_count_y; fy++) {
+			int block_index = fy*dct_block_count_x + fx;
+			int block_offs = 64 * block_index;
+
+			const uint8_t *y_data = y_plane + pitch*(fy*16) + fx*16;
+			const uint8_t *c_data = c_plane + pitch*(fy*8) + fx*16;
+			uint8_t *samples = state->macroblock_samples + MACROBLOCK_SAMPLES_SIZE * block_index;
+			uint64_t hash = hash_macroblock(y_data, c_data, pitch);
+
+			if (
+				state->macroblock_hashes_valid &&
+				(state->macroblock_hashes[block_index] == hash) &&
+				match_macroblock(samples, y_data, c_data, pitch)
+			) {
+				stripe->reused_macroblocks++;
+				continue;
+			}
+
+			state->macroblock_hashes[block_index] = hash;
+			store_macroblock(samples, y_data, c_data, pitch);
+
+			int16_t *blocks[6] = {
+				state->dct_block_lists[0] + block_offs,
+				state->dct_block_lists[1] + block_offs,
+				state->dct_block_lists[2] + block_offs,
+				state->dct_block_lists[3] + block_offs,
+				state->dct_block_lists[4] + block_offs,
+				state->dct_block_lists[5] + block_offs
+			};
+
+#ifdef MDEC_USE_X86_SIMD
+			if (use_sse2)
+				gather_macroblock_sse2(blocks, y_data, c_data, pitch);
+			else
+#endif
+				gather_macroblock(blocks, y_data, c_data, pitch);
+
+			for (int i = 0; i < 6; i++) {
+				bool flat = false;
+
+				if (is_flat_block(blocks[i])) {
+					int16_t dc = state->flat_dc_coeffs[blocks[i][0] + 128];
+
+					if (dc != FLAT_BLOCK_INELIGIBLE) {
+						memset(blocks[i], 0, sizeof(int16_t) * 8*8);
+						blocks[i][0] = dc;
+						flat = true;
+					}
+				}
+
+				state->flat_blocks[6 * block_index + i] = flat;
+
+				if (flat)
+					continue;
+
+#if 0
+				transform_dct_block(blocks[i]);
+#else
+				state->dct_context->fdct(blocks[i]);
+#endif
+			}
+		}
+	}
+}
+
+// Quantizes all blocks in the stripe and either only sums up the lengths of
+// their Huffman codes (when searching for the quantization scale to use) or
+// stores the codes into the stripe's token list, to be written out in order
+// once all stripes are done.
+static void encode_stripe(mdec_stripe_t *stripe, bool dry_run) {
+	mdec_encoder_t *encoder = stripe->encoder;
+	mdec_encoder_state_t *state = &(encoder->state);
+
+	int dct_block_count_x = (encoder->video_width + 15) / 16;
+	int dct_block_count_y = (encoder->video_height + 15) / 16;
+
+#ifdef MDEC_USE_X86_SIMD
+	bool use_sse2 = __builtin_cpu_supports("sse2");
+	bool use_avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+	stripe->bits_used = 0;
+	stripe->uncomp_hwords_used = 0;
+	stripe->token_count = 0;
+
+	for (int fx = stripe->first_column; fx < (stripe->first_column + stripe->column_count); fx++) {
+		for (int fy = 0; fy < dct_block_count_y; fy++) {
+			int block_index = fy*dct_block_count_x + fx;
+
+			for (int i = 0; i < 6; i++) {
+				const int16_t *block = state->dct_block_lists[i] + 64 * block_index;
+				int16_t coeffs[8*8], scan[8*8];
+				uint64_t mask;
+				uint32_t outword = state->dc_codes[6 * block_index + i];
+
+				// Flat blocks have no AC coefficients at any scale, so their DC
+				// and end of block codes can be stored as a single code.
+				if (state->flat_blocks[6 * block_index + i]) {
+					outword = HUFFMAN_CODE((outword >> 24) + 2, ((outword & 0xFFFFFF) << 2) | 0x2);
+
+					stripe->bits_used += outword >> 24;
+					stripe->tokens[stripe->token_count] = outword;
+					stripe->token_count += !dry_run;
+
+					stripe->uncomp_hwords_used += 2;
+					continue;
+				}
+
+#ifdef MDEC_USE_X86_SIMD
+				if (use_avx2)
+					quantize_block_avx2(block, stripe->quant_table, stripe->quant_recips, coeffs);
+				else
+#endif
+					quantize_block(block, stripe->quant_table, stripe->quant_recips, coeffs);
+
+				for (int j = 0; j < 64; j++)
+					scan[j] = coeffs[dct_zagzig_table[j]];
+
+#ifdef MDEC_USE_X86_SIMD
+				if (use_sse2)
+					mask = get_nonzero_mask_sse2(scan);
+				else
+#endif
+					mask = get_nonzero_mask(scan);
+
+				stripe->bits_used += outword >> 24;
+				stripe->tokens[stripe->token_count] = outword;
+				stripe->token_count += !dry_run;
+
+				// The DC coefficient has already been encoded.
+				mask &= ~1ULL;
+
+				for (int last = 0; mask; mask &= mask - 1) {
+					int j = count_trailing_zeroes(mask);
+					int zeroes = j - last - 1;
+
+					outword = state->ac_huffman_map[(zeroes << 10) | (scan[j] & 0x3FF)];
+					last = j;
+
+					stripe->bits_used += outword >> 24;
+					stripe->tokens[stripe->token_count] = outword;
+					stripe->token_count += !dry_run;
+
+					stripe->uncomp_hwords_used++;
+				}
+
+				// Store end of block
+				outword = HUFFMAN_CODE(2, 0x2);
+
+				stripe->bits_used += 2;
+				stripe->tokens[stripe->token_count] = outword;
+				stripe->token_count += !dry_run;
+
+				stripe->uncomp_hwords_used += 2;
+				//stripe->uncomp_hwords_used = (stripe->uncomp_hwords_used+0xF)&~0xF;
+			}
+
+			// Give up early if the frame is already known not to fit.
+			if (dry_run && (stripe->bits_used > stripe->max_bits))
+				return;
 		}
 	}
+}
+
+static void *run_stripe_task(void *arg) {
+	mdec_stripe_t *stripe = (mdec_stripe_t *)arg;
+
+	switch (stripe->task) {
+		case STRIPE_TASK_TRANSFORM:
+			transform_stripe(stripe);
+			break;
+
+		case STRIPE_TASK_COUNT_BITS:
+			encode_stripe(stripe, true);
+			break;
+
+		case STRIPE_TASK_ENCODE:
+			encode_stripe(stripe, false);
+			break;
+	}
+
+	return NULL;
+}
+
+// Runs the task set in each stripe, with all stripes but the last one being
+// processed by worker threads, and waits for all of them to finish.
+static void run_stripe_tasks(mdec_encoder_t *encoder) {
+	int last = encoder->stripe_count - 1;
+
+	for (int i = 0; i < last; i++) {
+		mdec_stripe_t *stripe = &(encoder->stripes[i]);
+
+		stripe->thread_started = !pthread_create(&(stripe->thread), NULL, &run_stripe_task, stripe);
+
+		if (!stripe->thread_started)
+			run_stripe_task(stripe);
+	}
+
+	run_stripe_task(&(encoder->stripes[last]));
+
+	for (int i = 0; i < last; i++) {
+		mdec_stripe_t *stripe = &(encoder->stripes[i]);
+
+		if (stripe->thread_started)
+			pthread_join(stripe->thread, NULL);
+
+		stripe->thread_started = false;
+	}
+}
+
+static void init_stripe_tasks(mdec_encoder_t *encoder, int task, int quant_scale) {
+	mdec_encoder_state_t *state = &(encoder->state);
+
+	// The bitstream is written in 16-bit units after an 8-byte header and must
+	// also fit the 10-bit end of frame code.
+	int max_bits = ((state->frame_max_size - 8) / 2) * 16 - 10;
+
+	for (int i = 0; i < encoder->stripe_count; i++) {
+		mdec_stripe_t *stripe = &(encoder->stripes[i]);
+
+		stripe->task = task;
+		stripe->max_bits = max_bits;
+
+		// The DC coefficient's quantization scale is always 8.
+		stripe->quant_table[0] = quant_dec[0] * 8;
 
-	// Store end of block
-	if (!encode_bits(state, 2, 0x2))
+		for (int j = 1; j < 64; j++)
+			stripe->quant_table[j] = quant_dec[j] * quant_scale;
+		for (int j = 0; j < 64; j++)
+			stripe->quant_recips[j] = QUANT_RECIPROCAL(stripe->quant_table[j]);
+	}
+}
+
+// Checks whether the frame would fit in frame_max_size bytes if encoded at the
+// given scale, without actually encoding it. This only sums up Huffman code
+// lengths, giving up as soon as the budget is exceeded.
+static bool frame_fits_at_scale(mdec_encoder_t *encoder, int quant_scale) {
+	init_stripe_tasks(encoder, STRIPE_TASK_COUNT_BITS, quant_scale);
+	run_stripe_tasks(encoder);
+
+	int bits_used = 0;
+
+	for (int i = 0; i < encoder->stripe_count; i++)
+		bits_used += encoder->stripes[i].bits_used;
+
+	return bits_used <= encoder->stripes[0].max_bits;
+}
+
+// Encodes the frame at the given scale. This should only be called once
+// frame_fits_at_scale() has confirmed the frame fits. The stripes' bit counts
+// are still checked against the budget before anything is written, so that
+// the output buffer can never overflow.
+static bool encode_frame_at_scale(mdec_encoder_t *encoder, int quant_scale) {
+	mdec_encoder_state_t *state = &(encoder->state);
+
+	uint32_t end_of_block;
+	int bits_used = 0;
+
+	if (encoder->video_codec == BS_CODEC_V2) {
+		end_of_block = 0x1FF;
+	} else {
+		end_of_block = 0x3FF;
+		assert(state->dc_huffman_map);
+	}
+
+	init_stripe_tasks(encoder, STRIPE_TASK_ENCODE, quant_scale);
+	run_stripe_tasks(encoder);
+
+	for (int i = 0; i < encoder->stripe_count; i++)
+		bits_used += encoder->stripes[i].bits_used;
+
+	if (bits_used > encoder->stripes[0].max_bits)
+		return false;
+
+	memset(state->frame_output, 0, state->frame_max_size);
+
+	state->quant_scale = quant_scale;
+	state->bits_value = 0;
+	state->bits_pending = 0;
+	state->uncomp_hwords_used = 0;
+	state->bytes_used = 8;
+
+	for (int i = 0; i < encoder->stripe_count; i++) {
+		mdec_stripe_t *stripe = &(encoder->stripes[i]);
+
+		for (int j = 0; j < stripe->token_count; j++)
+			encode_bits(state, stripe->tokens[j] >> 24, stripe->tokens[j] & 0xFFFFFF);
+
+		state->uncomp_hwords_used += stripe->uncomp_hwords_used;
+	}
+
+	// The budget check above is only valid if the tokens add up to the
+	// counted bits.
+	assert((state->bytes_used - 8) * 8 + state->bits_pending == bits_used);
+
+	encode_bits(state, 10, end_of_block);
+#if 0
+	encode_bits(state, 2, 0x2);
+#endif
+	flush_bits(state);
+
+	if (state->bytes_used > state->frame_max_size)
 		return false;
 
-	state->block_type++;
-	state->block_type %= 6;
 	state->uncomp_hwords_used += 2;
-	//state->uncomp_hwords_used = (state->uncomp_hwords_used+0xF)&~0xF;
 	return true;
 }
 
-bool init_mdec_encoder(mdec_encoder_t *encoder, bs_codec_t video_codec, int video_width, int video_height) {
+// Allocates the buffers and stripes that can not be shared between multiple
+// copies of the same encoder.
+static bool init_mdec_buffers(mdec_encoder_t *encoder, int stripe_count) {
+	mdec_encoder_state_t *state = &(encoder->state);
+
+	int dct_block_count_x = (encoder->video_width + 15) / 16;
+	int dct_block_count_y = (encoder->video_height + 15) / 16;
+	int dct_block_count = dct_block_count_x * dct_block_count_y;
+
+	if (stripe_count > dct_block_count_x)
+		stripe_count = dct_block_count_x;
+	if (stripe_count < 1)
+		stripe_count = 1;
+
+	for (int i = 0; i < 6; i++)
+		state->dct_block_lists[i] = malloc(dct_block_count * sizeof(int16_t) * 8*8);
+
+	state->dc_codes = malloc(dct_block_count * 6 * sizeof(uint32_t));
+	state->flat_blocks = malloc(dct_block_count * 6 * sizeof(bool));
+	state->macroblock_hashes = malloc(dct_block_count * sizeof(uint64_t));
+	state->macroblock_samples = malloc(dct_block_count * MACROBLOCK_SAMPLES_SIZE);
+	state->macroblock_hashes_valid = false;
+	state->frame_output = NULL;
+
+	encoder->stripe_count = 0;
+	encoder->stripes = malloc(stripe_count * sizeof(mdec_stripe_t));
+
+	if (encoder->stripes == NULL || state->dc_codes == NULL || state->flat_blocks == NULL || state->macroblock_hashes == NULL || state->macroblock_samples == NULL)
+		return false;
+	for (int i = 0; i < 6; i++) {
+		if (state->dct_block_lists[i] == NULL)
+			return false;
+	}
+
+	for (int first_column = 0; encoder->stripe_count < stripe_count; encoder->stripe_count++) {
+		mdec_stripe_t *stripe = &(encoder->stripes[encoder->stripe_count]);
+
+		stripe->encoder = encoder;
+		stripe->first_column = first_column;
+		stripe->column_count = (dct_block_count_x - first_column) / (stripe_count - encoder->stripe_count);
+		stripe->thread_started = false;
+		first_column += stripe->column_count;
+
+		// Each block takes up to 65 codes (DC, 63 AC coefficients and end of
+		// block).
+		stripe->tokens = malloc(stripe->column_count * dct_block_count_y * 6 * 65 * sizeof(uint32_t));
+
+		if (stripe->tokens == NULL) {
+			encoder->stripe_count++;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void destroy_mdec_buffers(mdec_encoder_t *encoder) {
+	mdec_encoder_state_t *state = &(encoder->state);
+
+	for (int i = 0; i < 6; i++) {
+		if (state->dct_block_lists[i] != NULL) {
+			free(state->dct_block_lists[i]);
+			state->dct_block_lists[i] = NULL;
+		}
+	}
+	if (state->dc_codes) {
+		free(state->dc_codes);
+		state->dc_codes = NULL;
+	}
+	if (state->flat_blocks) {
+		free(state->flat_blocks);
+		state->flat_blocks = NULL;
+	}
+	if (state->macroblock_hashes) {
+		free(state->macroblock_hashes);
+		state->macroblock_hashes = NULL;
+	}
+	if (state->macroblock_samples) {
+		free(state->macroblock_samples);
+		state->macroblock_samples = NULL;
+	}
+	for (int i = 0; i < encoder->stripe_count; i++)
+		free(encoder->stripes[i].tokens);
+
+	if (encoder->stripes) {
+		free(encoder->stripes);
+		encoder->stripes = NULL;
+		encoder->stripe_count = 0;
+	}
+}
+
+bool init_mdec_encoder(
+	mdec_encoder_t *encoder,
+	bs_codec_t video_codec,
+	int video_width,
+	int video_height,
+	int job_count,
+	int stripe_count
+) {
 	encoder->video_codec = video_codec;
 	encoder->video_width = video_width;
 	encoder->video_height = video_height;
+	encoder->stripe_count = 0;
+	encoder->stripes = NULL;
+	encoder->job_count = 0;
+	encoder->next_job = 0;
+	encoder->queued_jobs = 0;
+	encoder->jobs = NULL;
 
 	mdec_encoder_state_t *state = &(encoder->state);
 
@@ -525,34 +1178,78 @@ bool init_mdec_encoder(mdec_encoder_t *encoder, bs_codec_t video_codec, int vide
 	state->ac_huffman_map = malloc(0x10000 * sizeof(uint32_t));
 	state->dc_huffman_map = malloc(0x200 * 3 * sizeof(uint32_t));
 	state->coeff_clamp_map = malloc(0x10000 * sizeof(int16_t));
+	state->flat_dc_coeffs = malloc(0x100 * sizeof(int16_t));
 
 	if (
 		state->dct_context == NULL ||
 		state->ac_huffman_map == NULL ||
 		state->dc_huffman_map == NULL ||
-		state->coeff_clamp_map == NULL
+		state->coeff_clamp_map == NULL ||
+		state->flat_dc_coeffs == NULL
 	)
 		return false;
 
-	int dct_block_count_x = (video_width + 15) / 16;
-	int dct_block_count_y = (video_height + 15) / 16;
-	int dct_block_size = dct_block_count_x * dct_block_count_y * sizeof(int16_t) * 8*8;
+	if (!init_mdec_buffers(encoder, stripe_count))
+		return false;
+
+	state->quant_scale = 1;
+	state->last_frame_max_size = 0;
 
-	for (int i = 0; i < 6; i++) {
-		state->dct_block_lists[i] = malloc(dct_block_size);
+	avcodec_dct_init(state->dct_context);
+	init_dct_data(state, video_codec);
+	init_flat_dc_coeffs(state);
 
-		if (state->dct_block_lists[i] == NULL)
+	if (job_count <= 0)
+		return true;
+
+	// Each job gets a copy of the encoder, pointing to the same lookup tables
+	// and DCT context but with its own buffers. As frames are already being
+	// encoded in parallel, jobs do not further split them into stripes.
+	encoder->jobs = malloc(job_count * sizeof(mdec_frame_job_t));
+
+	if (encoder->jobs == NULL)
+		return false;
+
+	for (; encoder->job_count < job_count; encoder->job_count++) {
+		mdec_frame_job_t *job = &(encoder->jobs[encoder->job_count]);
+
+		memcpy(&(job->encoder), encoder, sizeof(mdec_encoder_t));
+		job->encoder.job_count = 0;
+		job->encoder.jobs = NULL;
+
+		job->video_frame = malloc(video_width * video_height * 3 / 2);
+		job->output_size = 0;
+		job->thread_started = false;
+
+		// Bump the count first so destroy_mdec_encoder() frees this job.
+		if (!init_mdec_buffers(&(job->encoder), 1) || job->video_frame == NULL) {
+			encoder->job_count++;
 			return false;
+		}
 	}
 
-	avcodec_dct_init(state->dct_context);
-	init_dct_data(state, video_codec);
 	return true;
 }
 
 void destroy_mdec_encoder(mdec_encoder_t *encoder) {
 	mdec_encoder_state_t *state = &(encoder->state);
 
+	for (int i = 0; i < encoder->job_count; i++) {
+		mdec_frame_job_t *job = &(encoder->jobs[i]);
+
+		if (job->thread_started)
+			pthread_join(job->thread, NULL);
+
+		free(job->video_frame);
+		free(job->encoder.state.frame_output);
+		destroy_mdec_buffers(&(job->encoder));
+	}
+	if (encoder->jobs) {
+		free(encoder->jobs);
+		encoder->jobs = NULL;
+		encoder->job_count = 0;
+	}
+
 	if (state->dct_context) {
 		av_free(state->dct_context);
 		state->dct_context = NULL;
@@ -569,12 +1266,12 @@ void destroy_mdec_encoder(mdec_encoder_t *encoder) {
 		free(state->coeff_clamp_map);
 		state->coeff_clamp_map = NULL;
 	}
-	for (int i = 0; i < 6; i++) {
-		if (state->dct_block_lists[i] != NULL) {
-			free(state->dct_block_lists[i]);
-			state->dct_block_lists[i] = NULL;
-		}
+	if (state->flat_dc_coeffs) {
+		free(state->flat_dc_coeffs);
+		state->flat_dc_coeffs = NULL;
 	}
+
+	destroy_mdec_buffers(encoder);
 }
 
 void encode_frame_bs(mdec_encoder_t *encoder, const uint8_t *video_frame) {
@@ -582,145 +1279,51 @@ void encode_frame_bs(mdec_encoder_t *encoder, const uint8_t *video_frame) {
 
 	assert(state->dct_context);
 
-	int pitch = encoder->video_width;
-#if 0
-	int real_index = state->frame_index - 1;
-	if (real_index > (video_frame_count - 1))
-		real_index = video_frame_count - 1;
-
-	const uint8_t *y_plane = video_frames + encoder->video_width * encoder->video_height * 3/2 * real_index;
-#else
-	const uint8_t *y_plane = video_frame;
-	const uint8_t *c_plane = y_plane + (encoder->video_width * encoder->video_height);
-#endif
-
-	int dct_block_count_x = (encoder->video_width + 15) / 16;
-	int dct_block_count_y = (encoder->video_height + 15) / 16;
-
 	// TODO: non-16x16-aligned videos
 	assert((encoder->video_width % 16) == 0);
 	assert((encoder->video_height % 16) == 0);
 
-	// Rearrange the Y/C planes returned by libswscale into macroblocks.
-	for (int fx = 0; fx < dct_block_count_x; fx++) {
-		for (int fy = 0; fy < dct_block_count_y; fy++) {
-			// Order: Cr Cb [Y1|Y2]
-			//              [Y3|Y4]
-			int block_offs = 64 * (fy*dct_block_count_x + fx);
-			int16_t *blocks[6] = {
-				state->dct_block_lists[0] + block_offs,
-				state->dct_block_lists[1] + block_offs,
-				state->dct_block_lists[2] + block_offs,
-				state->dct_block_lists[3] + block_offs,
-				state->dct_block_lists[4] + block_offs,
-				state->dct_block_lists[5] + block_offs
-			};
-
-			for (int y = 0; y < 8; y++) {
-				for (int x = 0; x < 8; x++) {
-					int k = y*8 + x;
-					int cx = fx*8 + x;
-					int cy = fy*8 + y;
-					int lx = fx*16 + x;
-					int ly = fy*16 + y;
-
-					blocks[0][k] = (int16_t)c_plane[pitch*cy + 2*cx + 0] - 128;
-					blocks[1][k] = (int16_t)c_plane[pitch*cy + 2*cx + 1] - 128;
-					blocks[2][k] = (int16_t)y_plane[pitch*(ly+0) + (lx+0)] - 128;
-					blocks[3][k] = (int16_t)y_plane[pitch*(ly+0) + (lx+8)] - 128;
-					blocks[4][k] = (int16_t)y_plane[pitch*(ly+8) + (lx+0)] - 128;
-					blocks[5][k] = (int16_t)y_plane[pitch*(ly+8) + (lx+8)] - 128;
-				}
-			}
-
-			for (int i = 0; i < 6; i++)
-#if 0
-				transform_dct_block(blocks[i]);
-#else
-				state->dct_context->fdct(blocks[i]);
-#endif
-		}
+	for (int i = 0; i < encoder->stripe_count; i++) {
+		encoder->stripes[i].task = STRIPE_TASK_TRANSFORM;
+		encoder->stripes[i].video_frame = video_frame;
 	}
 
-	uint32_t end_of_block;
+	run_stripe_tasks(encoder);
 
-	if (encoder->video_codec == BS_CODEC_V2) {
-		end_of_block = 0x1FF;
-	} else {
-		end_of_block = 0x3FF;
-		assert(state->dc_huffman_map);
-	}
+	state->macroblock_hashes_valid = true;
+
+	for (int i = 0; i < encoder->stripe_count; i++)
+		state->reused_macroblocks_sum += encoder->stripes[i].reused_macroblocks;
 
 	assert(state->ac_huffman_map);
 	assert(state->coeff_clamp_map);
 
-	// Attempt encoding the frame at the maximum quality. If the result is too
-	// large, increase the quantization scale and try again.
+	encode_dc_coeffs(encoder);
+
+	// Find the lowest quantization scale at which the frame fits. The encoded
+	// size is not monotonic in the scale (zeroing out a coefficient can merge
+	// the zero runs around it into a run that needs a longer escape code), so
+	// every scale has to be tried in order. Each attempt only counts bits and
+	// gives up as soon as the budget is exceeded; the frame is then encoded
+	// once at the scale found.
 	// TODO: if a frame encoded at scale N is too large but the same frame
 	// encoded at scale N+1 leaves a significant amount of free space, attempt
 	// compressing at scale N but optimizing coefficients away until it fits
 	// (like the old algorithm did)
-	for (
-		state->quant_scale = 1;
-		state->quant_scale < 64;
-		state->quant_scale++
-	) {
-		int16_t quant_table[8*8];
+	int fit_scale;
 
-		// The DC coefficient's quantization scale is always 8.
-		quant_table[0] = quant_dec[0] * 8;
-
-		for (int i = 1; i < 64; i++)
-			quant_table[i] = quant_dec[i] * state->quant_scale;
-
-		memset(state->frame_output, 0, state->frame_max_size);
-
-		state->block_type = 0;
-		state->last_dc_values[INDEX_CR] = 0;
-		state->last_dc_values[INDEX_CB] = 0;
-		state->last_dc_values[INDEX_Y] = 0;
-
-		state->bits_value = 0;
-		state->bits_left = 16;
-		state->uncomp_hwords_used = 0;
-		state->bytes_used = 8;
-
-		bool ok = true;
-		for (int fx = 0; ok && (fx < dct_block_count_x); fx++) {
-			for (int fy = 0; ok && (fy < dct_block_count_y); fy++) {
-				// Order: Cr Cb [Y1|Y2]
-				//              [Y3|Y4]
-				int block_offs = 64 * (fy*dct_block_count_x + fx);
-				int16_t *blocks[6] = {
-					state->dct_block_lists[0] + block_offs,
-					state->dct_block_lists[1] + block_offs,
-					state->dct_block_lists[2] + block_offs,
-					state->dct_block_lists[3] + block_offs,
-					state->dct_block_lists[4] + block_offs,
-					state->dct_block_lists[5] + block_offs
-				};
-
-				for(int i = 0; ok && (i < 6); i++)
-					ok = encode_dct_block(state, encoder->video_codec, blocks[i], quant_table);
-			}
-		}
+	for (fit_scale = 1; fit_scale < 64; fit_scale++) {
+		if (frame_fits_at_scale(encoder, fit_scale))
+			break;
+	}
 
-		if (!ok)
-			continue;
-		if (!encode_bits(state, 10, end_of_block))
-			continue;
-#if 0
-		if (!encode_bits(state, 2, 0x2))
-			continue;
-#endif
-		if (!flush_bits(state))
-			continue;
+	assert(fit_scale < 64);
 
-		state->uncomp_hwords_used += 2;
-		state->quant_scale_sum += state->quant_scale;
-		break;
-	}
-	assert(state->quant_scale < 64);
+	bool ok = encode_frame_at_scale(encoder, fit_scale);
+	assert(ok);
+	(void)ok;
+
+	state->quant_scale_sum += state->quant_scale;
 
 	// MDEC DMA is usually configured to transfer data in 32-word chunks.
 	state->uncomp_hwords_used = (state->uncomp_hwords_used+0x3F)&~0x3F;
@@ -752,33 +1355,190 @@ void encode_frame_bs(mdec_encoder_t *encoder, const uint8_t *video_frame) {
 		state->frame_output[0x006] = 0x03;
 
 	state->frame_output[0x007] = 0x00;
+	state->last_frame_max_size = state->frame_max_size;
 }
 
+// Outputs the last frame encoded again, as long as the result is guaranteed to
+// be the same as what encode_frame_bs() would produce for an identical frame
+// with the current frame_max_size. This is the case if the last frame still
+// fits and all scales below the one it was encoded at are known not to fit,
+// i.e. frame_max_size has not grown (unless the last frame was encoded at the
+// lowest scale). Returns false if the frame has to be encoded instead.
+bool reuse_frame_bs(mdec_encoder_t *encoder) {
+	mdec_encoder_state_t *state = &(encoder->state);
+
+	if (!state->last_frame_max_size || (state->bytes_used > state->frame_max_size))
+		return false;
+	if ((state->frame_max_size > state->last_frame_max_size) && (state->quant_scale > 1))
+		return false;
+
+	int dct_block_count_x = (encoder->video_width + 15) / 16;
+	int dct_block_count_y = (encoder->video_height + 15) / 16;
+
+	// Everything past the end of the bitstream is padding.
+	memset(state->frame_output + state->bytes_used, 0, state->frame_max_size - state->bytes_used);
+
+	state->quant_scale_sum += state->quant_scale;
+	state->reused_macroblocks_sum += dct_block_count_x * dct_block_count_y;
+	state->last_frame_max_size = state->frame_max_size;
+	return true;
+}
+
+static void *encode_frame_job(void *arg) {
+	mdec_frame_job_t *job = (mdec_frame_job_t *)arg;
+
+	encode_frame_bs(&(job->encoder), job->video_frame);
+	return NULL;
+}
+
+static void queue_frame_bs(mdec_encoder_t *encoder, const uint8_t *video_frame, bool duplicate) {
+	mdec_encoder_state_t *state = &(encoder->state);
+	mdec_frame_job_t *job = &(encoder->jobs[(encoder->next_job + encoder->queued_jobs) % encoder->job_count]);
+	mdec_encoder_state_t *job_state = &(job->encoder.state);
+
+	int last_frame_max_size = state->last_frame_max_size;
+
+	if (encoder->queued_jobs) {
+		mdec_frame_job_t *last_job = &(encoder->jobs[(encoder->next_job + encoder->queued_jobs - 1) % encoder->job_count]);
+		last_frame_max_size = last_job->encoder.state.frame_max_size;
+	}
+
+	// The size of each frame only depends on its index, so it can be worked
+	// out as soon as the frame is queued.
+	// TODO: work out an optimal block count for this
+	// TODO: calculate this all based on FPS
+	state->frame_block_overflow_num += state->frame_block_base_overflow;
+	job_state->frame_max_size = state->frame_block_overflow_num / state->frame_block_overflow_den * 2016;
+	state->frame_block_overflow_num %= state->frame_block_overflow_den;
+
+	if (job->output_size < job_state->frame_max_size) {
+		job->output_size = job_state->frame_max_size;
+		job_state->frame_output = realloc(job_state->frame_output, job->output_size);
+	}
+
+	// The frame is copied as the decoder may move its buffer around while the
+	// job is running.
+	memcpy(job->video_frame, video_frame, encoder->video_width * encoder->video_height * 3 / 2);
+	job_state->quant_scale_sum = 0;
+	job_state->reused_macroblocks_sum = 0;
+
+	// A duplicate frame given the same size limit as the previous one is always
+	// going to be an exact copy of it, which finish_frame_bs() can output once
+	// the previous frame is done. Other duplicates are encoded as usual.
+	job->duplicate = duplicate && (job_state->frame_max_size == last_frame_max_size);
+	job->thread_started = false;
+
+	if (!job->duplicate) {
+		job->thread_started = !pthread_create(&(job->thread), NULL, &encode_frame_job, job);
+
+		if (!job->thread_started)
+			encode_frame_job(job);
+	}
+
+	encoder->queued_jobs++;
+}
+
+static void queue_frames_bs(mdec_encoder_t *encoder, const uint8_t *video_frames, const bool *duplicate_frames, int video_frame_count) {
+	int frame_size = encoder->video_width * encoder->video_height * 3 / 2;
+
+	while (encoder->queued_jobs < encoder->job_count && encoder->queued_jobs < video_frame_count)
+		queue_frame_bs(
+			encoder,
+			video_frames + encoder->queued_jobs * frame_size,
+			duplicate_frames[encoder->queued_jobs]
+		);
+}
+
+static void finish_frame_bs(mdec_encoder_t *encoder) {
+	mdec_encoder_state_t *state = &(encoder->state);
+	mdec_frame_job_t *job = &(encoder->jobs[encoder->next_job]);
+	mdec_encoder_state_t *job_state = &(job->encoder.state);
+
+	if (job->thread_started)
+		pthread_join(job->thread, NULL);
+
+	job->thread_started = false;
+
+	state->frame_max_size = job_state->frame_max_size;
+
+	if (job->duplicate) {
+		if (reuse_frame_bs(encoder)) {
+			encoder->next_job = (encoder->next_job + 1) % encoder->job_count;
+			encoder->queued_jobs--;
+			return;
+		}
+
+		// Should not happen, but if it does encode the frame as usual.
+		encode_frame_job(job);
+	}
+
+	state->bytes_used = job_state->bytes_used;
+	state->blocks_used = job_state->blocks_used;
+	state->uncomp_hwords_used = job_state->uncomp_hwords_used;
+	state->quant_scale = job_state->quant_scale;
+	state->quant_scale_sum += job_state->quant_scale;
+	state->reused_macroblocks_sum += job_state->reused_macroblocks_sum;
+	state->last_frame_max_size = job_state->frame_max_size;
+	memcpy(state->frame_output, job_state->frame_output, job_state->frame_max_size);
+
+	encoder->next_job = (encoder->next_job + 1) % encoder->job_count;
+	encoder->queued_jobs--;
+}
+
+// video_frames should point to the decoder's buffer, holding video_frame_count
+// frames that have not yet been passed to the encoder. If jobs are enabled,
+// these are handed out to worker threads ahead of time; the returned number of
+// frames used only counts frames that were actually muxed, so they can be
+// retired from the buffer.
 int encode_sector_str(
 	mdec_encoder_t *encoder,
 	format_t format,
 	uint16_t str_video_id,
 	const uint8_t *video_frames,
+	const bool *duplicate_frames,
+	int video_frame_count,
 	uint8_t *output
 ) {
 	mdec_encoder_state_t *state = &(encoder->state);
-	int frame_size = encoder->video_width * encoder->video_height * 2;
+	int frame_size = encoder->video_width * encoder->video_height * 3 / 2;
 	int frames_used = 0;
 
 	while (state->frame_data_offset >= state->frame_max_size) {
 		state->frame_index++;
-		// TODO: work out an optimal block count for this
-		// TODO: calculate this all based on FPS
-		state->frame_block_overflow_num += state->frame_block_base_overflow;
-		state->frame_max_size = state->frame_block_overflow_num / state->frame_block_overflow_den * 2016;
-		state->frame_block_overflow_num %= state->frame_block_overflow_den;
-		state->frame_data_offset = 0;
 
-		encode_frame_bs(encoder, video_frames);
+		bool duplicate = (video_frame_count > 0) && duplicate_frames[0];
+
+		if (encoder->job_count) {
+			queue_frames_bs(encoder, video_frames, duplicate_frames, video_frame_count);
+
+			// If the buffer has run dry, encode whatever it holds (usually a
+			// copy of the last frame) as the serial path would.
+			if (!encoder->queued_jobs)
+				queue_frame_bs(encoder, video_frames, false);
+
+			finish_frame_bs(encoder);
+		} else {
+			// TODO: work out an optimal block count for this
+			// TODO: calculate this all based on FPS
+			state->frame_block_overflow_num += state->frame_block_base_overflow;
+			state->frame_max_size = state->frame_block_overflow_num / state->frame_block_overflow_den * 2016;
+			state->frame_block_overflow_num %= state->frame_block_overflow_den;
+
+			if (!duplicate || !reuse_frame_bs(encoder))
+				encode_frame_bs(encoder, video_frames);
+		}
+
+		state->frame_data_offset = 0;
 		video_frames += frame_size;
+		duplicate_frames++;
+		video_frame_count--;
 		frames_used++;
 	}
 
+	// Keep the workers busy while the current frame is being muxed.
+	if (encoder->job_count)
+		queue_frames_bs(encoder, video_frames, duplicate_frames, video_frame_count);
+
 	uint8_t header[32];
 	memset(header, 0, sizeof(header));
 
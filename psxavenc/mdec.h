@@ -24,6 +24,7 @@ freely, subject to the following restrictions:
 
 #pragma once
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <libavcodec/avdct.h>
@@ -38,37 +39,98 @@ typedef struct {
 	int frame_block_overflow_den;
 	int block_type;
 	int16_t last_dc_values[3];
-	uint16_t bits_value;
-	int bits_left;
+	uint64_t bits_value;
+	int bits_pending;
 	uint8_t *frame_output;
 	int bytes_used;
 	int blocks_used;
 	int uncomp_hwords_used;
 	int quant_scale;
 	int quant_scale_sum;
+	int last_frame_max_size; // frame_max_size the current output was encoded for
+	int reused_macroblocks_sum;
 
 	AVDCT *dct_context;
 	uint32_t *ac_huffman_map;
 	uint32_t *dc_huffman_map;
 	int16_t *coeff_clamp_map;
+	int16_t *flat_dc_coeffs; // DC coefficient of a flat block of each sample value
 	int16_t *dct_block_lists[6];
+	uint32_t *dc_codes; // Huffman codes for each block's DC coefficient
+	bool *flat_blocks; // Whether each block was flat and skipped the DCT
+	uint64_t *macroblock_hashes; // Hashes of the last frame's macroblocks
+	uint8_t *macroblock_samples; // Copies of the last frame's macroblocks
+	bool macroblock_hashes_valid;
 } mdec_encoder_state_t;
 
+typedef struct mdec_frame_job_t mdec_frame_job_t;
+typedef struct mdec_stripe_t mdec_stripe_t;
+
 typedef struct {
 	bs_codec_t video_codec;
 	int video_width;
 	int video_height;
 
 	mdec_encoder_state_t state;
+
+	// Column ranges processed in parallel within each frame
+	int stripe_count;
+	mdec_stripe_t *stripes;
+
+	// Frames encoded ahead of time by worker threads (STR only)
+	int job_count;
+	int next_job;
+	int queued_jobs;
+	mdec_frame_job_t *jobs;
 } mdec_encoder_t;
 
-bool init_mdec_encoder(mdec_encoder_t *encoder, bs_codec_t video_codec, int video_width, int video_height);
+struct mdec_stripe_t {
+	mdec_encoder_t *encoder;
+	int first_column;
+	int column_count;
+
+	// Input and output of the task being run
+	int task;
+	const uint8_t *video_frame;
+	uint32_t quant_table[8*8];
+	uint32_t quant_recips[8*8];
+	int max_bits;
+	int bits_used;
+	int uncomp_hwords_used;
+	int token_count;
+	int reused_macroblocks;
+	uint32_t *tokens;
+
+	pthread_t thread;
+	bool thread_started;
+};
+
+struct mdec_frame_job_t {
+	mdec_encoder_t encoder; // Shares the Huffman tables with the parent
+	uint8_t *video_frame;
+	bool duplicate; // Encoded only if the previous frame's output can't be reused
+	int output_size;
+	pthread_t thread;
+	bool thread_started;
+};
+
+bool init_mdec_encoder(
+	mdec_encoder_t *encoder,
+	bs_codec_t video_codec,
+	int video_width,
+	int video_height,
+	int job_count,
+	int stripe_count
+);
 void destroy_mdec_encoder(mdec_encoder_t *encoder);
 void encode_frame_bs(mdec_encoder_t *encoder, const uint8_t *video_frame);
+bool reuse_frame_bs(mdec_encoder_t *encoder);
 int encode_sector_str(
 	mdec_encoder_t *encoder,
 	format_t format,
 	uint16_t str_video_id,
 	const uint8_t *video_frames,
+	const bool *duplicate_frames,
+	int video_frame_count,
 	uint8_t *output
 );
@@ -0,0 +1,296 @@
+/*
+psxrelocate: CD-ROM sector relocation tool
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+Copyright (c) 2023, 2025 spicyjpeg
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <libpsxav.h>
+#include "config.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define MAX_THREADS 256
+
+static const uint8_t sync_pattern[12] = {
+	0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00
+};
+
+typedef struct {
+	uint8_t *sectors;
+	int sector_count;
+	int lba;
+	int skipped_count;
+	pthread_t thread;
+	bool thread_started;
+} relocate_job_t;
+
+// Rewrites the timecode of each sector (keeping its mode and, for Mode 2
+// sectors, its subheader) and regenerates its EDC and ECC. Sectors that do
+// not start with a sync pattern are left untouched.
+static void *relocate_sectors(void *arg) {
+	relocate_job_t *job = (relocate_job_t *)arg;
+
+	for (int i = 0; i < job->sector_count; i++) {
+		psx_cdrom_sector_t *sector = (psx_cdrom_sector_t *)(job->sectors + (size_t)i * PSX_CDROM_SECTOR_SIZE);
+		psx_cdrom_sector_xa_subheader_t subheader[2];
+		psx_cdrom_sector_type_t type;
+
+		if (memcmp(sector->mode1.sync, sync_pattern, sizeof(sync_pattern))) {
+			job->skipped_count++;
+			continue;
+		}
+
+		if (sector->mode1.header.mode == 0x01) {
+			type = PSX_CDROM_SECTOR_TYPE_MODE1;
+		} else if (sector->mode2.header.mode == 0x02) {
+			if (sector->mode2.subheader[0].submode & PSX_CDROM_SECTOR_XA_SUBMODE_FORM2)
+				type = PSX_CDROM_SECTOR_TYPE_MODE2_FORM2;
+			else
+				type = PSX_CDROM_SECTOR_TYPE_MODE2_FORM1;
+
+			memcpy(subheader, sector->mode2.subheader, sizeof(subheader));
+		} else {
+			job->skipped_count++;
+			continue;
+		}
+
+		psx_cdrom_init_sector(sector, job->lba + i, type);
+
+		if (type != PSX_CDROM_SECTOR_TYPE_MODE1)
+			memcpy(sector->mode2.subheader, subheader, sizeof(subheader));
+
+		psx_cdrom_calculate_checksums(sector, type);
+	}
+
+	return NULL;
+}
+
+static int relocate_buffer(uint8_t *sectors, int sector_count, int base_lba, int threads) {
+	relocate_job_t jobs[MAX_THREADS];
+	int sectors_per_job = (sector_count + threads - 1) / threads;
+	int skipped_count = 0;
+
+	for (int i = 0; i < threads; i++) {
+		relocate_job_t *job = &jobs[i];
+		int first = i * sectors_per_job;
+
+		job->sectors = sectors + (size_t)first * PSX_CDROM_SECTOR_SIZE;
+		job->sector_count = (first < sector_count) ? (sector_count - first) : 0;
+		job->lba = base_lba + first;
+		job->skipped_count = 0;
+
+		if (job->sector_count > sectors_per_job)
+			job->sector_count = sectors_per_job;
+	}
+
+	for (int i = 1; i < threads; i++) {
+		relocate_job_t *job = &jobs[i];
+
+		job->thread_started = !pthread_create(&(job->thread), NULL, relocate_sectors, job);
+
+		if (!job->thread_started)
+			relocate_sectors(job);
+	}
+
+	relocate_sectors(&jobs[0]);
+	skipped_count += jobs[0].skipped_count;
+
+	for (int i = 1; i < threads; i++) {
+		relocate_job_t *job = &jobs[i];
+
+		if (job->thread_started)
+			pthread_join(job->thread, NULL);
+
+		skipped_count += job->skipped_count;
+	}
+
+	return skipped_count;
+}
+
+// The file is mapped into memory where possible, so only the pages that are
+// actually modified get written back.
+static bool relocate_file(const char *path, int base_lba, int threads, int *sector_count, int *skipped_count) {
+#ifndef _WIN32
+	int fd = open(path, O_RDWR);
+
+	if (fd < 0)
+		return false;
+
+	struct stat info;
+
+	if (fstat(fd, &info)) {
+		close(fd);
+		return false;
+	}
+
+	*sector_count = info.st_size / PSX_CDROM_SECTOR_SIZE;
+	*skipped_count = 0;
+
+	if (*sector_count == 0) {
+		close(fd);
+		return true;
+	}
+
+	size_t length = (size_t)(*sector_count) * PSX_CDROM_SECTOR_SIZE;
+	uint8_t *sectors = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (sectors == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+
+	*skipped_count = relocate_buffer(sectors, *sector_count, base_lba, threads);
+
+	bool success = !msync(sectors, length, MS_SYNC);
+	munmap(sectors, length);
+	close(fd);
+	return success;
+#else
+	FILE *file = fopen(path, "r+b");
+
+	if (file == NULL)
+		return false;
+
+	fseeko(file, 0, SEEK_END);
+	*sector_count = ftello(file) / PSX_CDROM_SECTOR_SIZE;
+	*skipped_count = 0;
+
+	size_t length = (size_t)(*sector_count) * PSX_CDROM_SECTOR_SIZE;
+	uint8_t *sectors = malloc(length ? length : 1);
+
+	fseeko(file, 0, SEEK_SET);
+	bool success = (fread(sectors, 1, length, file) == length);
+
+	if (success) {
+		*skipped_count = relocate_buffer(sectors, *sector_count, base_lba, threads);
+
+		fseeko(file, 0, SEEK_SET);
+		success = (fwrite(sectors, 1, length, file) == length);
+	}
+
+	free(sectors);
+	fclose(file);
+	return success;
+#endif
+}
+
+static const char *const usage =
+	"Usage:\n"
+	"    psxrelocate [-q] [-j threads] <base-lba> <file.xa|file.str>...\n"
+	"\n"
+	"Rewrites the sector headers and EDC/ECC of one or more files made up of\n"
+	"2352-byte sectors in place, as if they were placed on a disc starting at\n"
+	"the given LBA. If multiple files are given, each one starts right after\n"
+	"the previous one.\n"
+	"\n"
+	"    -h                Show this help message and exit\n"
+	"    -V                Show version information and exit\n"
+	"    -q                Suppress all non-error messages\n"
+	"    -j threads        Use specified number of threads (default 1)\n"
+	"\n";
+
+int main(int argc, const char **argv) {
+	bool quiet = false;
+	int threads = 1;
+	int arg_index = 1;
+
+	for (; arg_index < argc && argv[arg_index][0] == '-' && argv[arg_index][1] && !argv[arg_index][2]; arg_index++) {
+		switch (argv[arg_index][1]) {
+			case 'h':
+				printf("%s", usage);
+				return 0;
+
+			case 'V':
+				printf("psxrelocate " VERSION "\n");
+				return 0;
+
+			case 'q':
+				quiet = true;
+				break;
+
+			case 'j':
+				if (++arg_index >= argc) {
+					fprintf(stderr, "Missing thread count value after option\n");
+					return 1;
+				}
+
+				threads = strtol(argv[arg_index], NULL, 0);
+
+				if (threads < 1 || threads > MAX_THREADS) {
+					fprintf(stderr, "Invalid thread count: %d (must be in 1-%d range)\n", threads, MAX_THREADS);
+					return 1;
+				}
+				break;
+
+			default:
+				fprintf(stderr, "Unknown option: %s\n", argv[arg_index]);
+				return 1;
+		}
+	}
+
+	if ((argc - arg_index) < 2) {
+		fprintf(stderr, "%s", usage);
+		return 1;
+	}
+
+	int lba = strtol(argv[arg_index++], NULL, 0);
+
+	if (lba < 0) {
+		fprintf(stderr, "Invalid base LBA: %d (must be 0 or greater)\n", lba);
+		return 1;
+	}
+
+	for (; arg_index < argc; arg_index++) {
+		int sector_count, skipped_count;
+
+		if (!relocate_file(argv[arg_index], lba, threads, &sector_count, &skipped_count)) {
+			fprintf(stderr, "Failed to relocate file: %s\n", argv[arg_index]);
+			return 1;
+		}
+
+		if (!quiet)
+			fprintf(
+				stderr,
+				"%s: LBA %d-%d (%d sectors, %d skipped)\n",
+				argv[arg_index],
+				lba,
+				lba + sector_count - 1,
+				sector_count,
+				skipped_count
+			);
+
+		lba += sector_count;
+	}
+
+	return 0;
+}
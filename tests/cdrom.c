@@ -0,0 +1,231 @@
+/*
+libpsxav: MDEC video + SPU/XA-ADPCM audio library (CD-ROM checksum tests)
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+// Checks psx_cdrom_calculate_checksums() against known good EDC and ECC values,
+// and the optimized EDC and ECC routines against simple reference versions.
+// cdrom.c is included directly so that its internal functions can be tested.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../libpsxav/cdrom.c"
+
+// Reference values for the sectors generated by fill_sector() at LBA 1234.
+// These were cross-checked against a separate CRC and Reed-Solomon syndrome
+// implementation.
+static const uint8_t mode1_edc[4] = {
+	0xB7, 0x62, 0x59, 0x0F
+};
+
+static const uint8_t mode1_p[172] = {
+	0x8C, 0xA1, 0x25, 0xBB, 0xD3, 0x78, 0x7E, 0xC6, 0x05, 0x44, 0xF5, 0xFB,
+	0xB3, 0x8C, 0xB1, 0x90, 0x66, 0x88, 0x22, 0x48, 0x4E, 0xF5, 0x0E, 0x70,
+	0x90, 0x55, 0x2A, 0xC2, 0x3B, 0xDE, 0x23, 0x85, 0x23, 0x3C, 0xEB, 0x69,
+	0x5D, 0xAB, 0xFA, 0x72, 0x7A, 0x1E, 0xC2, 0x31, 0xB1, 0x73, 0xEF, 0x55,
+	0x57, 0xF4, 0x0C, 0x04, 0x8D, 0xA2, 0xE1, 0xA1, 0x57, 0xA4, 0xA4, 0xF2,
+	0x25, 0xD9, 0xBE, 0xF6, 0x10, 0xD1, 0x8D, 0x47, 0xE7, 0x73, 0x14, 0xBA,
+	0x1D, 0xAC, 0x05, 0x90, 0x3C, 0x59, 0x72, 0xFD, 0x64, 0x95, 0xA0, 0x9B,
+	0xC8, 0xDD, 0x4E, 0xDB, 0x27, 0x11, 0x7A, 0x71, 0xAF, 0xB5, 0x44, 0x05,
+	0x0F, 0x1F, 0xD6, 0xF6, 0x50, 0xB2, 0x5C, 0x73, 0x7C, 0x53, 0xE5, 0x75,
+	0xF9, 0x1A, 0xAA, 0x18, 0x07, 0xDD, 0xBE, 0x30, 0x43, 0x8E, 0x2B, 0xCF,
+	0x32, 0xF7, 0x6D, 0xDE, 0xB9, 0xDF, 0xC3, 0x20, 0x60, 0x4B, 0x88, 0x63,
+	0x0D, 0x01, 0xD6, 0xB9, 0x57, 0x11, 0xBE, 0x85, 0x09, 0x26, 0xB4, 0x00,
+	0x56, 0x33, 0xA6, 0x32, 0xDD, 0x53, 0x34, 0xE9, 0x9D, 0x63, 0xFA, 0xAE,
+	0xAA, 0xA3, 0x7C, 0xED, 0x54, 0x90, 0x2A, 0x7E, 0x75, 0x5C, 0xD1, 0xDE,
+	0x25, 0xF9, 0xB6, 0x1A
+};
+
+static const uint8_t mode1_q[104] = {
+	0x6C, 0xC5, 0xDF, 0xDA, 0xE3, 0xD4, 0x43, 0x67, 0x48, 0x61, 0x2A, 0xD4,
+	0x52, 0xBD, 0xE1, 0xB1, 0x98, 0x93, 0xB2, 0xB3, 0xC3, 0xDC, 0xCD, 0x55,
+	0xEA, 0xCF, 0xBE, 0x86, 0xF5, 0x0E, 0xF1, 0x26, 0x6A, 0x24, 0xE2, 0x62,
+	0x48, 0x32, 0xA8, 0x07, 0x63, 0x41, 0x6F, 0xC6, 0xEE, 0x26, 0x00, 0x90,
+	0x15, 0xAA, 0x29, 0x35, 0x79, 0xEF, 0x56, 0xD6, 0x62, 0xD9, 0x40, 0x7E,
+	0x5A, 0x99, 0xBB, 0x9E, 0x1E, 0xE2, 0xE1, 0x6D, 0x1F, 0x86, 0x28, 0xCD,
+	0xD7, 0x4E, 0x6F, 0xFB, 0x18, 0x0B, 0x47, 0xC3, 0x33, 0xF0, 0xAF, 0xF2,
+	0xF7, 0x86, 0x6E, 0xE8, 0xA7, 0xFC, 0xDE, 0x0A, 0xD3, 0x28, 0x4D, 0x7E,
+	0x87, 0x06, 0x33, 0xA1, 0x75, 0x89, 0xE0, 0xC2
+};
+
+static const uint8_t form1_edc[4] = {
+	0xA6, 0x9B, 0xF0, 0x4E
+};
+
+static const uint8_t form1_p[172] = {
+	0xB4, 0x2E, 0xE6, 0x6F, 0x9C, 0xF2, 0xA0, 0x0D, 0x8C, 0xB1, 0x0D, 0x4E,
+	0xD3, 0x78, 0x7E, 0xC6, 0x05, 0x44, 0xF5, 0xFB, 0xB3, 0x8C, 0xB1, 0x90,
+	0x66, 0x88, 0x22, 0x48, 0x4E, 0xF5, 0x0E, 0x70, 0x90, 0x55, 0x2A, 0xC2,
+	0x3B, 0xDE, 0x23, 0x85, 0x23, 0x3C, 0xEB, 0x69, 0x5D, 0xAB, 0xFA, 0x72,
+	0x7A, 0x1E, 0xC2, 0x31, 0xB1, 0x73, 0xEF, 0x55, 0x57, 0xF4, 0x0C, 0x04,
+	0x8D, 0xA2, 0xE1, 0xA1, 0x57, 0xA4, 0xA4, 0xF2, 0x25, 0xD9, 0xBE, 0xF6,
+	0x10, 0xD1, 0x8D, 0x47, 0xE7, 0x73, 0x14, 0xBA, 0x1D, 0xAC, 0x36, 0x86,
+	0xDA, 0x9A, 0xB3, 0x8F, 0x53, 0x24, 0x19, 0x90, 0xD6, 0xCA, 0x4E, 0xD3,
+	0x33, 0xE5, 0x7A, 0x71, 0xAF, 0xB5, 0x44, 0x05, 0x0F, 0x1F, 0xD6, 0xF6,
+	0x50, 0xB2, 0x5C, 0x73, 0x7C, 0x53, 0xE5, 0x75, 0xF9, 0x1A, 0xAA, 0x18,
+	0x07, 0xDD, 0xBE, 0x30, 0x43, 0x8E, 0x2B, 0xCF, 0x32, 0xF7, 0x6D, 0xDE,
+	0xB9, 0xDF, 0xC3, 0x20, 0x60, 0x4B, 0x88, 0x63, 0x0D, 0x01, 0xD6, 0xB9,
+	0x57, 0x11, 0xBE, 0x85, 0x09, 0x26, 0xB4, 0x00, 0x56, 0x33, 0xA6, 0x32,
+	0xDD, 0x53, 0x34, 0xE9, 0x9D, 0x63, 0xFA, 0xAE, 0xAA, 0xA3, 0x7C, 0xED,
+	0x76, 0x7F, 0x65, 0xFC
+};
+
+static const uint8_t form1_q[104] = {
+	0x2C, 0x26, 0xED, 0xCB, 0xDC, 0x41, 0x8B, 0x75, 0x3D, 0xE1, 0x0A, 0xFF,
+	0xC8, 0x51, 0x7F, 0xBC, 0xA6, 0xD7, 0xF8, 0xAC, 0xA2, 0x10, 0xDB, 0xB1,
+	0xD1, 0x2D, 0xCE, 0x7B, 0x8E, 0x35, 0xDA, 0xAB, 0x72, 0x44, 0xB2, 0x97,
+	0x6C, 0x17, 0x8D, 0x39, 0x5E, 0x81, 0x30, 0x30, 0x94, 0x3C, 0xF6, 0x2E,
+	0x15, 0x7D, 0x42, 0x1B, 0xFA, 0x7A, 0x7C, 0x8D, 0xD4, 0xA3, 0x48, 0x9D,
+	0x04, 0x2C, 0x25, 0x34, 0x62, 0x88, 0xF8, 0x79, 0x51, 0xF8, 0xBA, 0x5E,
+	0xD3, 0x22, 0x1D, 0xF1, 0xB5, 0x9E, 0x87, 0x31, 0x51, 0x1E, 0x3B, 0x97,
+	0x10, 0x09, 0x08, 0x63, 0xEA, 0xCC, 0x1E, 0x3E, 0x54, 0x30, 0x0F, 0x96,
+	0x41, 0x82, 0x81, 0x4B, 0x68, 0x06, 0xC3, 0x82
+};
+
+static const uint8_t form2_edc[4] = {
+	0x7F, 0x24, 0x10, 0xB2
+};
+
+static uint32_t rng_state = 1;
+
+static uint8_t next_random_byte(void) {
+	rng_state = rng_state * 1103515245 + 12345;
+	return (uint8_t)(rng_state >> 16);
+}
+
+// Bit-by-bit EDC calculation, as done by libpsxav before the table and
+// PCLMULQDQ versions were introduced.
+static uint32_t edc_crc32_reference(const uint8_t *data, int length) {
+	uint32_t edc = 0;
+
+	for (int i = 0; i < length; i++) {
+		edc ^= 0xFF & (uint32_t)data[i];
+
+		for (int j = 0; j < 8; j++)
+			edc = (edc >> 1) ^ (EDC_CRC32_POLYNOMIAL * (edc & 0x1));
+	}
+
+	return edc;
+}
+
+static int failures = 0;
+
+static void check_bytes(const char *name, const uint8_t *actual, const uint8_t *expected, int length) {
+	if (!memcmp(actual, expected, length))
+		return;
+
+	for (int i = 0; i < length; i++) {
+		if (actual[i] != expected[i]) {
+			fprintf(stderr, "%s: mismatch at byte %d (got 0x%02X, expected 0x%02X)\n", name, i, actual[i], expected[i]);
+			break;
+		}
+	}
+
+	failures++;
+}
+
+static void fill_sector(psx_cdrom_sector_t *sector, psx_cdrom_sector_type_t type) {
+	uint8_t *data = (uint8_t *)sector;
+	int start = (type == PSX_CDROM_SECTOR_TYPE_MODE1) ? 0x10 : 0x18;
+	int end = (type == PSX_CDROM_SECTOR_TYPE_MODE2_FORM2) ? 0x92C : (start + 0x800);
+
+	memset(sector, 0, sizeof(psx_cdrom_sector_t));
+	psx_cdrom_init_sector(sector, 1234, type);
+
+	rng_state = 1;
+	for (int i = start; i < end; i++)
+		data[i] = next_random_byte();
+}
+
+static void test_known_sectors(void) {
+	psx_cdrom_sector_t sector;
+	uint8_t *data = (uint8_t *)&sector;
+
+	fill_sector(&sector, PSX_CDROM_SECTOR_TYPE_MODE1);
+	psx_cdrom_calculate_checksums(&sector, PSX_CDROM_SECTOR_TYPE_MODE1);
+	check_bytes("Mode 1 EDC", data + 0x810, mode1_edc, sizeof(mode1_edc));
+	check_bytes("Mode 1 P parity", data + 0x81C, mode1_p, sizeof(mode1_p));
+	check_bytes("Mode 1 Q parity", data + 0x8C8, mode1_q, sizeof(mode1_q));
+
+	fill_sector(&sector, PSX_CDROM_SECTOR_TYPE_MODE2_FORM1);
+	psx_cdrom_calculate_checksums(&sector, PSX_CDROM_SECTOR_TYPE_MODE2_FORM1);
+	check_bytes("Mode 2 Form 1 EDC", data + 0x818, form1_edc, sizeof(form1_edc));
+	check_bytes("Mode 2 Form 1 P parity", data + 0x81C, form1_p, sizeof(form1_p));
+	check_bytes("Mode 2 Form 1 Q parity", data + 0x8C8, form1_q, sizeof(form1_q));
+
+	fill_sector(&sector, PSX_CDROM_SECTOR_TYPE_MODE2_FORM2);
+	psx_cdrom_calculate_checksums(&sector, PSX_CDROM_SECTOR_TYPE_MODE2_FORM2);
+	check_bytes("Mode 2 Form 2 EDC", data + 0x92C, form2_edc, sizeof(form2_edc));
+}
+
+// Compares every EDC and ECC code path available on this CPU against the
+// reference ones, using random data, lengths and alignments.
+static void test_random_data(int iterations) {
+	uint8_t buffer[PSX_CDROM_SECTOR_SIZE + 16];
+
+	pthread_once(&tables_once, &init_tables);
+
+	for (int i = 0; i < iterations; i++) {
+		for (int j = 0; j < (int)sizeof(buffer); j++)
+			buffer[j] = next_random_byte();
+
+		int offset = next_random_byte() & 15;
+		int length = ((next_random_byte() << 8) | next_random_byte()) % (PSX_CDROM_SECTOR_SIZE + 1);
+		const uint8_t *data = buffer + offset;
+
+		uint32_t expected = edc_crc32_reference(data, length);
+
+		if (edc_crc32_tables(0, data, length) != expected) {
+			fprintf(stderr, "EDC (tables): mismatch for length %d\n", length);
+			failures++;
+		}
+#ifdef CDROM_USE_X86_SIMD
+		if (length >= 64 && __builtin_cpu_supports("pclmul") && edc_crc32_pclmul(data, length) != expected) {
+			fprintf(stderr, "EDC (PCLMULQDQ): mismatch for length %d\n", length);
+			failures++;
+		}
+#endif
+
+		uint8_t parity[ECC_P_MAJOR_COUNT * 2];
+		uint8_t expected_parity[ECC_P_MAJOR_COUNT * 2];
+
+		ecc_compute_block(data, ECC_P_MAJOR_COUNT, ECC_P_MINOR_COUNT, 2, ECC_P_MAJOR_COUNT, expected_parity);
+#ifdef CDROM_USE_X86_SIMD
+		if (__builtin_cpu_supports("sse2")) {
+			ecc_compute_p_sse2(data, parity);
+			check_bytes("P parity (SSE2)", parity, expected_parity, sizeof(parity));
+		}
+#endif
+		(void)parity;
+	}
+}
+
+int main(void) {
+	test_known_sectors();
+	test_random_data(2000);
+
+	if (failures) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	return 0;
+}